@@ -26,12 +26,14 @@ const static char LOGIN_SENT[] PROGMEM = "Login sent";
 const static char PASSWORD_SENT[] PROGMEM = "Password sent";
 const static char LOGIN_PASSWORD_SENT[] PROGMEM = "Login & Pwd sent";
 const static char NEED_FORMAT[] PROGMEM = "Format needed";
+const static char PIN_CHANGE_FAILED[] PROGMEM = "PIN change failed";
+const static char ENTRY_UNREADABLE[] PROGMEM = "ERROR: bad entry";
 const static char LOGIN_GRANTED[] PROGMEM = "OK";
 const static char LOGIN_DENIED[] PROGMEM = "DENIED";
 const static char DEVICE_FULL[] PROGMEM = "Error: device full";
 const static char ACCOUNT_TITLE_INPUT[] PROGMEM = "Account? ";
 const static char ACCOUNT_LOGIN_INPUT[] PROGMEM = "Login? ";
-const static char PASSWORD_LENGTH_INPUT[] PROGMEM = "Length? [0-16] ";
+const static char PASSWORD_LENGTH_INPUT[] PROGMEM = "Length? [0-32] ";
 const static char PASSWORD_VALUE_INPUT[] PROGMEM = "Pwd? ";
 const static char STORING_NEW_PASSWORD[] PROGMEM = "Storing...";
 const static char DELETING_ENTRY[] PROGMEM = "Deleting...";
@@ -47,13 +49,15 @@ const static char MENU_SETUP[] PROGMEM       = "Setup           ";
 #define MAIN_MENU_NB_ENTRIES 3
 
 const static char MENU_SETPWD[] PROGMEM      = "New Password   ";
+const static char MENU_EDITPWD[] PROGMEM     = "Edit Password  ";
 const static char MENU_CLEARPWD[] PROGMEM    = "Delete Password";
 const static char MENU_FORMAT[] PROGMEM      = "Format         ";
+const static char MENU_CHANGEPIN[] PROGMEM   = "Change PIN     ";
 const static char MENU_NB_ENTRIES[] PROGMEM  = "Check entries  ";
 //const static char MENU_TEST1[] PROGMEM       = "TEST1          ";
 //const static char MENU_TEST2[] PROGMEM       = "TEST2          ";
-//#define MENU_MANAGE_PASSWORDS_NB_ENTRIES 6
-#define MENU_MANAGE_PASSWORDS_NB_ENTRIES 4
+//#define MENU_MANAGE_PASSWORDS_NB_ENTRIES 8
+#define MENU_MANAGE_PASSWORDS_NB_ENTRIES 6
 
 const static char MENU_SETPWD_GENERATE[] PROGMEM    = "Generate";
 const static char MENU_SETPWD_MANUALINPUT[] PROGMEM = "Manually";
@@ -150,6 +154,7 @@ bool __attribute__ ((noinline)) confirmChoice(char* text)
     while (1) {
 
       check_buttons();
+      eeprom.poll();
 
       // User pushed validation button  
       if (button_justpressed[YButtonIndex]) {
@@ -246,6 +251,7 @@ bool __attribute__ ((noinline)) getStringFromUser( char* dst, const uint8_t numC
     while (1) {
 
       check_buttons();
+      eeprom.poll();
 
       // If finish button was pushed, exit
       if (button_justpressed[StartButtonIndex]) {
@@ -392,6 +398,7 @@ int __attribute__ ((noinline)) generic_menu(int nbEntries, uint8_t** menutexts)
   while (1) {
 
     check_buttons();
+    eeprom.poll();
 
     // If validation button was pushed, return currently selected entry
     if (button_justpressed[YButtonIndex]) {
@@ -507,11 +514,13 @@ int __attribute__ ((noinline)) main_menu() {
 int __attribute__ ((noinline)) menu_manage_passwords() {
   uint8_t* menutexts[MENU_MANAGE_PASSWORDS_NB_ENTRIES];
   menutexts[0] =   (uint8_t*)&MENU_SETPWD;
-  menutexts[1] =   (uint8_t*)&MENU_CLEARPWD;
-  menutexts[2] =   (uint8_t*)&MENU_FORMAT;
-  menutexts[3] =   (uint8_t*)&MENU_NB_ENTRIES;  
-  //menutexts[4] =   (uint8_t*)&MENU_TEST1;
-  //menutexts[5] =   (uint8_t*)&MENU_TEST2;  
+  menutexts[1] =   (uint8_t*)&MENU_EDITPWD;
+  menutexts[2] =   (uint8_t*)&MENU_CLEARPWD;
+  menutexts[3] =   (uint8_t*)&MENU_FORMAT;
+  menutexts[4] =   (uint8_t*)&MENU_CHANGEPIN;
+  menutexts[5] =   (uint8_t*)&MENU_NB_ENTRIES;  
+  //menutexts[6] =   (uint8_t*)&MENU_TEST1;
+  //menutexts[7] =   (uint8_t*)&MENU_TEST2;  
   return generic_menu(MENU_MANAGE_PASSWORDS_NB_ENTRIES, menutexts);
 }
 
@@ -585,7 +594,7 @@ void __attribute__ ((noinline)) generatePassword() {
   int len;
   bool validated=false;
 
-  if( entryNum == NUM_ENTRIES ) {
+  if( entryNum >= ES.getMaxEntries() ) {
     displayCenteredMessageFromStoredString((uint8_t*)&DEVICE_FULL);
     delay(MSG_DISPLAY_DELAY);
     return;
@@ -636,11 +645,11 @@ void __attribute__ ((noinline)) generatePassword() {
       entry.passwordOffset = strlen(entry.data)+1;  
       len = atoi(len_string);
 
-      if (len > PASSWORD_MAX_LENGTH){
+      if (len > PASSWORD_GENERATED_MAX_LENGTH){
             displayCenteredMessageFromStoredString((uint8_t*)&INVALID_VALUE);
             delay(MSG_DISPLAY_DELAY);
       }
-    } while(len > PASSWORD_MAX_LENGTH);
+    } while(len > PASSWORD_GENERATED_MAX_LENGTH);
     
     putRandomChars( ((entry.data)+entry.passwordOffset),len);
     
@@ -658,7 +667,7 @@ void __attribute__ ((noinline)) inputPassword() {
   entry_t entry;
   bool validated=false;
 
-  if( entryNum == NUM_ENTRIES ) {
+  if( entryNum >= ES.getMaxEntries() ) {
     displayCenteredMessageFromStoredString((uint8_t*)&DEVICE_FULL);
     delay(MSG_DISPLAY_DELAY);
     return;
@@ -708,6 +717,26 @@ void __attribute__ ((noinline)) inputPassword() {
   } 
 }
 
+typedef struct {
+  uint8_t first;
+  uint8_t maxEntryLength;
+} titleRows_t;
+
+// Print one line of the entry list, called by ES.forEachTitle()
+void printTitleRow(uint8_t entryNum, const char* title, void* ctx) {
+  titleRows_t* rows = (titleRows_t*)ctx;
+  int entryLen = strlen(title);
+  // keep track of longest title to optimize nb of characters needing redraw
+  if (entryLen > rows->maxEntryLength) rows->maxEntryLength = entryLen;
+  display.setCursor(2*CHAR_XSIZE,(entryNum-rows->first)*CHAR_YSIZE);
+  display.print(title);
+  if (entryLen<rows->maxEntryLength) {
+    for (int k=0;k<rows->maxEntryLength-entryLen;k++){
+      display.print(' ');
+    }
+  }
+}
+
 // Display a scrolling list of stored entries, and wait for user to select one
 int __attribute__ ((noinline)) pickEntry() {
 
@@ -715,14 +744,16 @@ int __attribute__ ((noinline)) pickEntry() {
   byte menu_line_offset_max = 0;
   byte selector_line_index = 0;
   byte selector_line_index_max = 0;
-  char menuEntryText[ENTRY_TITLE_SIZE];
   bool needMenuRefresh = true;
   bool needSelectorRefresh = true;
 
   uint8_t nbEntries=0;
   uint8_t entryIdx=0;
   bool hasEntry=false;
-  uint8_t maxEntryLength=0;
+  titleRows_t rows;
+  uint32_t elapsed;
+
+  rows.maxEntryLength = 0;
 
   // get stats about stored entries
   nbEntries = ES.getNbEntries();
@@ -744,6 +775,7 @@ int __attribute__ ((noinline)) pickEntry() {
   while (1) {
 
     check_buttons();
+    eeprom.poll();
 
     // If validation button was pushed, return currently selected entry
     if (button_justpressed[YButtonIndex]) {
@@ -803,29 +835,27 @@ int __attribute__ ((noinline)) pickEntry() {
            needSelectorRefresh = true;
         }
     }     
+    // Left/right jump to the previous/next first letter
+    else if (button_justpressed[LeftButtonIndex] || button_justpressed[RightButtonIndex]) {
+        entryIdx = menu_line_offset + selector_line_index;
+        if (button_justpressed[LeftButtonIndex]) {
+          entryIdx = ES.prevInitial(entryIdx);
+        } else {
+          entryIdx = ES.nextInitial(entryIdx);
+        }
+        menu_line_offset = (entryIdx > menu_line_offset_max)?menu_line_offset_max:entryIdx;
+        selector_line_index = entryIdx - menu_line_offset;
+        needMenuRefresh = true;
+        needSelectorRefresh = true;
+    }
 
     // Render modified text entries if updated
     if (needMenuRefresh) {   
-      int y = 0;
-      for (int i=0; i < SCREEN_MAX_NB_LINES; i++) {
-        if (i>= nbEntries) {
-          break;
-        } else {
-
-          ES.getTitle(menu_line_offset+i, menuEntryText);
-          int entryLen = strlen(menuEntryText);
-          // keep track of longest title to optimize nb of characters needing redraw
-          if (entryLen > maxEntryLength) maxEntryLength = entryLen;
-          display.setCursor(2*CHAR_XSIZE,y);
-          display.print(menuEntryText);
-          if (entryLen<maxEntryLength) {
-             for (int k=0;k<maxEntryLength-entryLen;k++){
-               display.print(' ');
-             }
-           }        
-          y+= CHAR_YSIZE;
-        }
-      } 
+      // all visible titles in one pass
+      rows.first = menu_line_offset;
+      ES.forEachTitle(menu_line_offset, SCREEN_MAX_NB_LINES, printTitleRow, &rows, &elapsed);
+      DEBUG( Serial.print("titles read in (us):"); )
+      DEBUG( Serial.println(elapsed); )
 
       // If there are extra entries above screen upper limit, display an Up arrow in the upper right corner
       if(menu_line_offset != 0) {
@@ -879,6 +909,90 @@ int __attribute__ ((noinline)) pickEntry() {
   } 
 }
 
+// Asks for the new title, login and password of entry, each answer left
+// empty keeps the current value. False when cancelled.
+bool __attribute__ ((noinline)) editEntryFields(entry_t* entry, char* input, char* login) {
+  char buf[ENTRY_TITLE_SIZE+1];
+  bool validated=false;
+
+  memset(login, 0, ACCOUNT_LOGIN_LENGTH+1);
+  strncpy(login, entry->data, ACCOUNT_LOGIN_LENGTH);
+
+  MultilineInputBuffer mlib;
+  mlib.nbBuffers=4;
+  mlib.buffers[0]= UpperCaseLetters;
+  mlib.buffer_size[0] = strlen(mlib.buffers[0]);
+  mlib.buffers[1]= LowerCaseLetters;
+  mlib.buffer_size[1] = strlen(mlib.buffers[1]);
+  mlib.buffers[2]= SpecialCharacters;
+  mlib.buffer_size[2] = strlen(mlib.buffers[2]);
+  mlib.buffers[3]= Numbers;
+  mlib.buffer_size[3] = strlen(mlib.buffers[3]);  
+
+  // Query user for entry Title       
+  getStringFromFlash(buf, (uint8_t*)&ACCOUNT_TITLE_INPUT);
+  memset(input, 0, PASSWORD_GENERATED_MAX_LENGTH+1);
+  validated = getStringFromUser(input, ACCOUNT_TITLE_LENGTH, buf, mlib );
+  // CANCEL management
+  if (!validated) return false;
+  if (input[0]) {
+    memset(entry->title, 0, ENTRY_TITLE_SIZE);
+    strcpy(entry->title, input);
+  }
+  
+  // Query user for entry login
+  getStringFromFlash(buf, (uint8_t*)&ACCOUNT_LOGIN_INPUT);
+  memset(input, 0, PASSWORD_GENERATED_MAX_LENGTH+1);
+  validated = getStringFromUser(input, ACCOUNT_LOGIN_LENGTH, buf, mlib );
+  // CANCEL management
+  if (!validated) return false;
+  if (input[0]) strcpy(login, input);
+  
+  // Query user for entry pwd
+  getStringFromFlash(buf, (uint8_t*)&PASSWORD_VALUE_INPUT);
+  memset(input, 0, PASSWORD_GENERATED_MAX_LENGTH+1);
+  validated = getStringFromUser(input, PASSWORD_MAX_LENGTH, buf, mlib );    
+  // CANCEL management
+  if (!validated) return false;
+  if (!input[0]) strncpy(input, entry->data+entry->passwordOffset, PASSWORD_GENERATED_MAX_LENGTH);
+
+  memset(entry->data, 0, sizeof(entry->data));
+  strcpy(entry->data, login);
+  entry->passwordOffset = strlen(entry->data)+1;
+  strcpy((entry->data)+entry->passwordOffset, input);
+  return true;
+}
+
+// Edit a stored entry in place. The plaintext copies are wiped on the way
+// out, cancelled or not, as the key is after unlock.
+void __attribute__ ((noinline)) editPassword() {
+  entry_t entry;
+  char input[PASSWORD_GENERATED_MAX_LENGTH+1];
+  char login[ACCOUNT_LOGIN_LENGTH+1];
+  int entryNum = pickEntry();
+
+  if (entryNum == RET_EMPTY) {
+    displayCenteredMessageFromStoredString((uint8_t*)&DEVICE_EMPTY);
+    delay(MSG_DISPLAY_DELAY);
+    return;
+  }
+  if (entryNum == RET_CANCEL) return;
+
+  ES.getEntry(entryNum, &entry);
+
+  if (editEntryFields(&entry, input, login)) {
+    display.clearDisplay();    
+
+    displayCenteredMessageFromStoredString((uint8_t*)&STORING_NEW_PASSWORD);
+
+    ES.updateEntry( entryNum, &entry );  
+  }
+
+  memset(&entry, 0, sizeof(entry));
+  memset(input, 0, sizeof(input));
+  memset(login, 0, sizeof(login));
+}
+
 ////////////////////
 // MISC
 ////////////////////
@@ -970,16 +1084,85 @@ void __attribute__ ((noinline)) format()
     }
   }
   
-  ES.format( (byte*)code1, user );
+  uint32_t duration = ES.format( (byte*)code1, user );
+
+  sprintf(buf, "Done in %lu.%lus", (unsigned long)(duration / 1000), (unsigned long)((duration % 1000) / 100));
+  displayCenteredMessage(buf);
+  delay(MSG_DISPLAY_DELAY);
+  DEBUG( Serial.print("Format time (ms): "); Serial.println(duration); )
+}
+
+//////////////
+// PIN CHANGE 
+//////////////
+bool login(char* key);
+
+void showPinChangeDone(uint32_t duration)
+{
+  char buf[32];
+  sprintf(buf, "%d in %lu.%lus", ES.getNbEntries(), (unsigned long)(duration / 1000), (unsigned long)((duration % 1000) / 100));
+  displayCenteredMessage(buf);
+  delay(MSG_DISPLAY_DELAY);
+  DEBUG( Serial.print("PIN change time (ms): "); Serial.println(duration); )
+  DEBUG( if (duration) { Serial.print("Entries/s: "); Serial.println(ES.getNbEntries() * 1000UL / duration); } )
+}
+
+void __attribute__ ((noinline)) changePin()
+{
+  char code0[USERCODE_BUFF_LEN];
+  char code1[USERCODE_BUFF_LEN];
+  char code2[USERCODE_BUFF_LEN];
+  char buf[32];
+  uint32_t duration;
+
+  // Keys are derived from the whole buffers
+  memset(code0, 0, USERCODE_BUFF_LEN);
+  memset(code1, 0, USERCODE_BUFF_LEN);
+  memset(code2, 0, USERCODE_BUFF_LEN);
+
+  MultilineInputBuffer mlib;
+  mlib.nbBuffers=1;
+  mlib.buffers[0]= Numbers;
+  mlib.buffer_size[0] = strlen(mlib.buffers[0]);
+
+  // Current code, then the new one twice
+  getStringFromFlash(buf, (uint8_t*)&CODE_INVITE);
+  if (!getStringFromUser(code0, USERCODE_LENGTH, buf, mlib)) return;
+
+  getStringFromFlash(buf, (uint8_t*)&NEW_CODE_INVITE);
+  if (!getStringFromUser(code1, USERCODE_LENGTH, buf, mlib)) return;
+
+  getStringFromFlash(buf, (uint8_t*)&REPEAT_CODE_INVITE);
+  if (!getStringFromUser(code2, USERCODE_LENGTH, buf, mlib)) return;
+
+  if (memcmp(code1,code2,USERCODE_BUFF_LEN)!=0) {
+    displayCenteredMessageFromStoredString((uint8_t*)&NEW_CODE_MISMATCH);
+    delay(MSG_DISPLAY_DELAY);
+    return;
+  }
+
+  // A wrong current code locks the storage, login again
+  if (!ES.changePass((byte*)code0, (byte*)code1, &duration)) {
+    displayCenteredMessageFromStoredString((uint8_t*)&LOGIN_DENIED);
+    delay(MSG_DISPLAY_DELAY);
+    memset(code0, 0, USERCODE_BUFF_LEN);
+    while (!login(code0));
+  } else {
+    showPinChangeDone(duration);
+  }
+
+  memset(code0, 0, USERCODE_BUFF_LEN);
+  memset(code1, 0, USERCODE_BUFF_LEN);
+  memset(code2, 0, USERCODE_BUFF_LEN);
 }
 /////////
 // LOGIN 
 /////////
-bool __attribute__ ((noinline)) login()
+// key is left holding the storage key, callers clear it
+bool __attribute__ ((noinline)) login(char* key)
 {
-  char key[USERCODE_BUFF_LEN+1];
   char buf[32];
-  memset(key,0,USERCODE_BUFF_LEN+1);
+  memset(key,0,USERCODE_BUFF_LEN);
   uint8_t ret=0;
 
   // Request passcode from user
@@ -1128,6 +1311,7 @@ void setup()   {
 
   // Initialize OLED display
   display.begin(SSD1306_SWITCHCAPVCC, DISPLAY_I2C_ADDR);
+  I2CprobeClock();
   display.ssd1306_command(SSD1306_SEGREMAP );
   display.ssd1306_command(SSD1306_COMSCANINC);
   display.clearDisplay();
@@ -1165,6 +1349,9 @@ void setup()   {
     pinMode(buttons[i], INPUT_PULLUP);
   }
 
+  // debug feature to measure display flush and EEPROM read times at each bus speed
+  //I2Cbenchmark();
+
   // debug feature to force reformatting
   //messUpEEPROMFormat();
   
@@ -1185,11 +1372,23 @@ void setup()   {
   }
   
   // Login now
+  char key[USERCODE_BUFF_LEN];
   bool login_status = false;
   do {
-    login_status = login();
+    login_status = login(key);
   } while (login_status==false);
 
+  // Go on with a PIN change cut short by a reset
+  if (ES.passChangePending()) {
+    uint32_t duration;
+    if (ES.resumePassChange((byte*)key, &duration)) {
+      showPinChangeDone(duration);
+    } else {
+      displayCenteredMessageFromStoredString((uint8_t*)&PIN_CHANGE_FAILED);
+      delay(MSG_DISPLAY_DELAY);
+    }
+  }
+  memset(key,0,USERCODE_BUFF_LEN);
 }
 
 void printNbEntries()
@@ -1200,8 +1399,25 @@ void printNbEntries()
   int nbEntries = ES.getNbEntries();
   display.print(nbEntries);
   display.print('/');
-  display.print(NUM_ENTRIES);
+  display.print(ES.getMaxEntries());
+  display.display();
+
+  // Then check them all for corruption, first few bad ones listed
+  uint8_t bad[4];
+  uint32_t duration;
+  char buf[24];
+  uint8_t nbBad = ES.scrub(bad, sizeof(bad), &duration);
+  
+  sprintf(buf, "%d bad (%lu.%lus)", nbBad, (unsigned long)(duration / 1000), (unsigned long)((duration % 1000) / 100));
+  display.setCursor(0,CURSOR_Y_SECOND_LINE);
+  display.print(buf);
+  display.setCursor(0,CURSOR_Y_THIRD_LINE);
+  for (uint8_t i=0; (i < nbBad) && (i < sizeof(bad)); i++) {
+    display.print(bad[i]+1);
+    display.print(' ');
+  }
   display.display();
+  DEBUG( Serial.print("Scrub time (ms): "); Serial.println(duration); )
   delay(2000);
 
 }
@@ -1334,7 +1550,8 @@ void loop() {
   int selection = main_menu();
 
   switch (selection) {
-    entry_t temp;
+    char field[ENTRY_DATA_SIZE];
+    bool sent;
 
     case MAIN_MENU_SENDPWD:
       // Let user pick an entry from a list
@@ -1347,37 +1564,44 @@ void loop() {
         
         DEBUG( Serial.print("picked entry:"); )
         DEBUG( Serial.println(entry_choice1); )
-        ES.getEntry(entry_choice1, &temp);
-        DEBUG( Serial.print("password for this entry:"); )
 
         /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         // This is where the critical step happens: send the decoded login and/or password over the serial link (to Bluetooth or wired keyboard interface)
         /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         entry_choice2 = 0;
         // Stay in this menu until cancel button is pressed. This is to allow to send login then password (for example) without having to re-select the menu twice.
+        // Login and password are decrypted when sent, each on its own.
         while (entry_choice2 != RET_CANCEL) {
           entry_choice2 = menu_send_pwd();
           switch (entry_choice2) {
+            // Nothing is typed from an entry that does not read back
             case SENDPWD_MENU_LOGINONLY:
-              Serial.print(temp.data);
-              displayCenteredMessageFromStoredString((uint8_t*)&LOGIN_SENT);
+              sent = ES.getLogin(entry_choice1, field, sizeof(field));
+              if (sent) Serial.print(field);
+              displayCenteredMessageFromStoredString((uint8_t*)(sent ? LOGIN_SENT : ENTRY_UNREADABLE));
               delay(MSG_DISPLAY_DELAY);               
               break;
             case SENDPWD_MENU_PWDNONLY:
-              Serial.print(temp.data+temp.passwordOffset); 
-              displayCenteredMessageFromStoredString((uint8_t*)&PASSWORD_SENT);
+              sent = ES.getPassword(entry_choice1, field, sizeof(field));
+              if (sent) Serial.print(field); 
+              displayCenteredMessageFromStoredString((uint8_t*)(sent ? PASSWORD_SENT : ENTRY_UNREADABLE));
               delay(MSG_DISPLAY_DELAY);       
               break;
             case SENDPWD_MENU_LOGIN_TAB_PWD:
-              Serial.print(temp.data);
-              Serial.print((char)9); // tab key
-              Serial.print(temp.data+temp.passwordOffset);  
-              displayCenteredMessageFromStoredString((uint8_t*)&LOGIN_PASSWORD_SENT);
+              sent = ES.getLogin(entry_choice1, field, sizeof(field));
+              if (sent) {
+                Serial.print(field);
+                Serial.print((char)9); // tab key
+                sent = ES.getPassword(entry_choice1, field, sizeof(field));
+              }
+              if (sent) Serial.print(field);  
+              displayCenteredMessageFromStoredString((uint8_t*)(sent ? LOGIN_PASSWORD_SENT : ENTRY_UNREADABLE));
               delay(MSG_DISPLAY_DELAY);    
               break;              
             default:
               break;
           }
+          memset(field, 0, sizeof(field));
         } 
       }
       break;
@@ -1403,6 +1627,10 @@ void loop() {
           }
           break;
         
+        case MANAGEPWD_MENU_EDITPWD:
+          editPassword();
+          break;
+
         case MANAGEPWD_MENU_DELPWD:
           entry_choice2 = pickEntry();
           DEBUG( Serial.print("clear entry "); Serial.println(entry_choice2);)
@@ -1422,6 +1650,10 @@ void loop() {
           if (confirmChoice((char*)"Sure?")) format();
           break;
 
+        case MANAGEPWD_MENU_CHANGEPIN:
+          changePin();
+          break;
+
         case MANAGEPWD_MENU_CHECKNBENTRIES:
           printNbEntries();
           break;      
@@ -1464,5 +1696,16 @@ void loop() {
   }
 
   DEBUG( Serial.print("Watermark after main loop action: "); Serial.println(StackMarginWaterMark()); )
+  DEBUG( Serial.print("EEPROM write wait (us): "); Serial.println(eeprom.getWaitTime()); eeprom.resetWaitTime(); )
+  DEBUG(
+  eeprom_cache_stats_t cs = eeprom.getCacheStats();
+  Serial.print("EEPROM cache hits/misses/flushes: "); Serial.print(cs.hits); Serial.print('/'); Serial.print(cs.misses); Serial.print('/'); Serial.println(cs.flushes);
+  eeprom.resetCacheStats(); )
+  DEBUG(
+  eeprom_write_stats_t ws = eeprom.getWriteStats();
+  Serial.print("EEPROM page writes/elided, bytes elided: "); Serial.print(ws.pageWrites); Serial.print('/'); Serial.print(ws.pagesElided); Serial.print(", "); Serial.println(ws.bytesElided);
+  eeprom.resetWriteStats(); )
+  DEBUG( printEEPROMIoStats(); )
+  DEBUG( Serial.print("EEPROM wake-ups/wake time (us): "); Serial.print(eeprom.getWakeCount()); Serial.print('/'); Serial.println(eeprom.getWakeTime()); eeprom.resetWakeStats(); )
 }
 
@@ -18,11 +18,11 @@
 
 #include "EncryptedStorage.h"
 #include "eeprom.h"
+#include "counterlog.h"
 #include "Entropy.h"
 #include "display.h" 
 #include "utils.h"
 #include <util/atomic.h>
-#include <Wire.h>
 #include <TermTool.h>
 
 #define FALSE 0
@@ -34,15 +34,27 @@
 //44-59		- Iv (16 bytes)
 //60-91		- Encrypted password (32 bytes)
 //92-123	- Background noise for password (32 bytes)
-//124-124	- Keyboard Layout (1 byte)
+//124-124	- Nb of entries (1 byte), until moved to the counter log
 
 //We reserve 1024 bytes for a rainy day
+//128-255	- Check values of packed slots 0-127, see checkOffset()
+//256-767	- Counter log (see counterlog.h)
+//768-863	- Scratch slot for the layout migration, PIN changes and updates
+//896-1022	- Check values of packed slots 128-254
+//1024-1278	- Slot map, physical slot of each entry in alphabetical order (1 byte each)
 #define EEPROM_ENTRY_START_ADDR 1280
+#define EEPROM_MIGRATION_SCRATCH 768
+#define EEPROM_PASS_CHANGE_KEY_LOCATION 864 //Old key during a PIN change, after the scratch slot
+#define EEPROM_SLOT_MAP_LOCATION 1024
+#define EEPROM_CHECK_LOCATION 128
+#define EEPROM_CHECK_LOCATION_HIGH 896
 
 #define ENTRY_SIZE sizeof(entry_t) // 80
-#define EEPROM_ENTRY_DISTANCE 96 // EntrySize + 16 for iv
+#define EEPROM_ENTRY_DISTANCE 128 // EntrySize + 16 for iv, padded to a page so that no entry straddles two
+#define EEPROM_ENTRY_DISTANCE_PACKED 96 // Packed layout of vaults formatted before
 #define ENTRY_FULL_CBC_BLOCKS 5 //Blocksize / 16 for encryption
 #define ENTRY_NAME_CBC_BLOCKS 2 //Blocksize of decryption of title
+#define ENTRY_DATA_OFFSET (ENTRY_TITLE_SIZE + 1) //Login starts after title and passwordOffset
 
 #define EEPROM_IDENTIFIER_LOCATION 0
 #define HEADER_EEPROM_IDENTIFIER_LEN 12
@@ -63,13 +75,268 @@ const static char eepromIdentifierTxt[HEADER_EEPROM_IDENTIFIER_LEN] PROGMEM  =
 #define EEPROM_NB_ENTRIES_LOCATION	(EEPROM_PASS_BACKGROUND_LOCATION + EEPROM_PASS_BACKGROUND_LENGTH)
 #define EEPROM_NB_ENTRIES_LENGTH 1
 
+//Progress of format() is redrawn at most this often
+#define FORMAT_PROGRESS_INTERVAL_MS 250
+
+//Set in COUNTER_MIGRATION when the entry being moved is in the scratch slot
+#define MIGRATION_STAGED 0x8000
+
+//COUNTER_PASS_CHANGE: next entry in the low bits, a check of the old key in
+//the high 16. Staged as above, the scratch slot then holds the next entry
+//encrypted with the new key.
+#define PASS_CHANGE_NONE 0
+#define PASS_CHANGE_ENTRY 0x1FFF
+#define PASS_CHANGE_HEADER 0x2000   //New header in the scratch slot, see initialize()
+#define PASS_CHANGE_PENDING 0x4000
+#define PASS_CHANGE_STAGED 0x8000
+#define PASS_CHANGE_HEADER_LENGTH (EEPROM_IV_LENGTH + EEPROM_PASS_CIPHER_LENGTH + EEPROM_PASS_BACKGROUND_LENGTH)
+
+//COUNTER_MAP_MOVE: from, to and the slot moved, a byte each, of a move in the
+//slot map spanning several write pages. See moveEntry().
+#define MAP_MOVE_NONE 0xFFFFFFFF
+
+//COUNTER_STAGED_SLOT: slot whose new contents are in the scratch slot, see
+//stageEntry()
+#define STAGED_NONE 0xFFFFFFFF
+
+//IV counter, see putIv()
+#define IV_COUNTER_LENGTH 4
+#define IV_COUNTER_BLOCK 16
+
+//Index among all entries of the nth one with skip left out
+#define skipped( n, skip ) ((n) + ((n) >= (skip)))
+
 //Read the IV which comes after 12 + 32 bytes and is 16 bytes long. (Identifier + Unit name)
 #define headerIdentifierOffsetAndIv(iv) I2E_Read( EEPROM_IV_LOCATION, iv, EEPROM_IV_LENGTH )
-#define entryOffset( entryNum ) ((EEPROM_ENTRY_START_ADDR)+(EEPROM_ENTRY_DISTANCE*(entryNum)))
+#define entryOffset( slot ) ((EEPROM_ENTRY_START_ADDR)+((uint16_t)entryDistance*(slot)))
+
+// Slot size of the vault in use, EEPROM_ENTRY_DISTANCE unless not migrated yet
+static uint8_t entryDistance = EEPROM_ENTRY_DISTANCE;
+
+// Check value of a slot: crc8 of its iv and cipher. Page slots have it right
+// after the cipher, in the same page write. Packed slots have no room to
+// spare, theirs are in the reserved area.
+#define checkOffset( slot ) ((entryDistance == EEPROM_ENTRY_DISTANCE)?(entryOffset(slot) + EEPROM_IV_LENGTH + ENTRY_SIZE): \
+                             (((slot) < 128)?(EEPROM_CHECK_LOCATION + (slot)):(EEPROM_CHECK_LOCATION_HIGH - 128 + (slot))))
 
 void EncryptedStorage::initialize()
 {
-  I2E_Read(EEPROM_NB_ENTRIES_LOCATION, &nbEntries, EEPROM_NB_ENTRIES_LENGTH);
+  uint32_t value;
+  char name[EEPROM_DEVICENAME_LENGTH];
+
+  eeprom.detect();
+  counters.initialize();
+
+  // Vaults formatted before the counter log have the count in the header only
+  if( counters.get(COUNTER_NB_ENTRIES, &value) )
+  {
+    nbEntries = value;
+  } else {
+    I2E_Read(EEPROM_NB_ENTRIES_LOCATION, &nbEntries, EEPROM_NB_ENTRIES_LENGTH);
+  }
+
+  // ...and no IV counter
+  ivLimit = (counters.get(COUNTER_IV, &value))?value:0;
+  ivNext = ivLimit;
+
+  // ...and the packed layout
+  setLayout( (counters.get(COUNTER_ENTRY_DISTANCE, &value))?value:EEPROM_ENTRY_DISTANCE_PACKED );
+
+  // Too many entries for slotMap (ES_MAX_ENTRIES), left alone, unlock() refuses it
+  if( nbEntries > maxEntries ) return;
+
+  if( (entryDistance != EEPROM_ENTRY_DISTANCE) && readHeader(name) )
+  {
+    migrateLayout();
+  }
+
+  loadSlotMap();
+
+  // ...and no check values
+  if( !counters.get(COUNTER_CHECKS, &value) && readHeader(name) )
+  {
+    buildChecks();
+  }
+
+  // A PIN change cut short while writing its new header, see changePass()
+  if( counters.get(COUNTER_PASS_CHANGE, &value) && (value & PASS_CHANGE_HEADER) )
+  {
+    passChangeHeader();
+  }
+
+  // An update cut short, see stageEntry()
+  if( counters.get(COUNTER_STAGED_SLOT, &value) && (value != STAGED_NONE) )
+  {
+    finishStagedEntry(value);
+  }
+}
+
+// Vaults from before the map keep their entries in order: identity map.
+// The counter holds the number of slots the stored map covers, slots added
+// since (larger chip) are free and map to themselves.
+void __attribute__ ((noinline)) EncryptedStorage::loadSlotMap()
+{
+  uint32_t mapped;
+
+  if( !counters.get(COUNTER_SLOT_MAP, &mapped) )
+  {
+    mapped = 0;
+  }
+  if( mapped > maxEntries )
+  {
+    mapped = maxEntries;
+  }
+
+#if ES_TITLE_CACHE_ENTRIES > 0
+  clearTitleCache();
+#endif
+  I2E_Read(EEPROM_SLOT_MAP_LOCATION, slotMap, mapped);
+  if( mapped < maxEntries )
+  {
+    for(uint16_t i = mapped; i < maxEntries; i++)
+    {
+      slotMap[i] = i;
+    }
+    I2E_Write(EEPROM_SLOT_MAP_LOCATION + mapped, slotMap + mapped, maxEntries - mapped);
+    counters.set(COUNTER_SLOT_MAP, maxEntries);
+  }
+  finishMapMove();
+}
+
+// A move of the map cut short by a reset. Write pages from the side of from
+// on are each either done or untouched. Done ones differ from the next one
+// at their common edge, the first untouched one still holds the value they
+// shifted out. The move goes on from there.
+void __attribute__ ((noinline)) EncryptedStorage::finishMapMove()
+{
+  uint32_t value;
+
+  if( !counters.get(COUNTER_MAP_MOVE, &value) || (value == MAP_MOVE_NONE) ) return;
+
+  uint8_t from = value;
+  uint8_t to = value >> 8;
+  uint8_t slot = value >> 16;
+  uint8_t page = eeprom.getWritePage();
+  int8_t dir = (from < to)?1:-1;
+  int16_t i = from;
+
+  if( slotMap[from] != slot )
+  {
+    do {
+      i = (dir > 0)?(i - (i % page) + page):(i - (i % page) - 1);
+    } while( ((dir > 0)?(i <= to):(i >= to)) && (slotMap[i] != slotMap[i - dir]) );
+  }
+
+  if( (dir > 0)?(i <= to):(i >= to) )
+  {
+    for(int16_t j = i; j != to; j += dir)
+    {
+      slotMap[j] = slotMap[j + dir];
+    }
+    slotMap[to] = slot;
+    storeMap(i, to);
+  }
+  counters.set(COUNTER_MAP_MOVE, MAP_MOVE_NONE);
+  eeprom.flush();
+}
+
+// The map from from to to, one write page after the other in that order
+void __attribute__ ((noinline)) EncryptedStorage::storeMap( uint8_t from, uint8_t to )
+{
+  uint8_t page = eeprom.getWritePage();
+  int16_t i = from;
+
+  for(;;)
+  {
+    int16_t edge = (from < to)?(i - (i % page) + page - 1):(i - (i % page));
+    if( (from < to)?(edge > to):(edge < to) )
+    {
+      edge = to;
+    }
+
+    uint8_t first = (i < edge)?i:edge;
+    I2E_Write(EEPROM_SLOT_MAP_LOCATION + first, slotMap + first, ((i < edge)?(edge - i):(i - edge)) + 1);
+    eeprom.flush();
+
+    if( edge == to ) break;
+    i = edge + ((from < to)?1:-1);
+  }
+}
+
+// As many entries as the chip(s) found can hold after the reserved area, up
+// to what slotMap has room for
+void EncryptedStorage::setLayout(uint8_t distance)
+{
+  uint32_t slots = (eeprom.getCapacity() - EEPROM_ENTRY_START_ADDR) / distance;
+  
+  entryDistance = distance;
+  maxEntries = (slots > ES_MAX_ENTRIES)?ES_MAX_ENTRIES:slots;
+}
+
+// Moves entries from packed to page-aligned slots, last one first since they
+// only move up. Progress is in the counter log so that an interrupted
+// migration resumes on next boot. Each step is on the chip before the next
+// one starts: a slot written ahead of time could overwrite a source still needed.
+void __attribute__ ((noinline)) EncryptedStorage::migrateLayout()
+{
+  byte buf[EEPROM_ENTRY_DISTANCE_PACKED];
+  uint32_t left;
+
+  if( ((uint32_t)EEPROM_ENTRY_START_ADDR + (uint32_t)EEPROM_ENTRY_DISTANCE * nbEntries) > eeprom.getCapacity() )
+  {
+    // Does not fit, stay packed
+    return;
+  }
+
+  if( counters.get(COUNTER_SLOT_MAP, &left) )
+  {
+    // Stayed packed before and got a slot map since, entries are no longer
+    // in the first slots
+    return;
+  }
+  
+  if( !counters.get(COUNTER_MIGRATION, &left) )
+  {
+    left = nbEntries;
+  }
+
+  while( left & ~MIGRATION_STAGED )
+  {
+    char tmp[24];
+    uint8_t i = (left & ~MIGRATION_STAGED) - 1;
+    uint16_t from = EEPROM_ENTRY_START_ADDR + (uint16_t)EEPROM_ENTRY_DISTANCE_PACKED * i;
+    uint16_t to = EEPROM_ENTRY_START_ADDR + (uint16_t)EEPROM_ENTRY_DISTANCE * i;
+
+    sprintf(tmp, "Upgrading: %d/%d", nbEntries - i, nbEntries);
+    displayCenteredMessage(tmp);
+
+    if(left & MIGRATION_STAGED)
+    {
+      from = EEPROM_MIGRATION_SCRATCH;
+    }
+    I2E_Read(from, buf, sizeof(buf));
+
+    // First entries overlap their own new slot, a copy interrupted halfway
+    // would lose the source: go through the scratch slot.
+    if( (to < from + sizeof(buf)) && (to != from) && !(left & MIGRATION_STAGED) )
+    {
+      I2E_Write(EEPROM_MIGRATION_SCRATCH, buf, sizeof(buf));
+      eeprom.flush();
+      counters.set(COUNTER_MIGRATION, left | MIGRATION_STAGED);
+      eeprom.flush();
+    }
+
+    I2E_Write(to, buf, sizeof(buf));
+    eeprom.flush();
+    
+    left = i;
+    counters.set(COUNTER_MIGRATION, left);
+    eeprom.flush();
+  }
+
+  counters.set(COUNTER_ENTRY_DISTANCE, EEPROM_ENTRY_DISTANCE);
+  eeprom.flush();
+  setLayout(EEPROM_ENTRY_DISTANCE);
 }
 
 uint8_t EncryptedStorage::getNbEntries()
@@ -77,6 +344,21 @@ uint8_t EncryptedStorage::getNbEntries()
   return nbEntries;
 }
 
+uint8_t EncryptedStorage::getMaxEntries()
+{
+  return maxEntries;
+}
+
+uint16_t EncryptedStorage::getTitleReads()
+{
+  return titleReads;
+}
+
+void EncryptedStorage::resetTitleReads()
+{
+  titleReads = 0;
+}
+
 bool __attribute__ ((noinline)) EncryptedStorage::readHeader(char* deviceName)
 {
   byte buf[HEADER_EEPROM_IDENTIFIER_LEN];
@@ -97,11 +379,29 @@ bool __attribute__ ((noinline)) EncryptedStorage::readHeader(char* deviceName)
 }
 
 bool __attribute__ ((noinline)) EncryptedStorage::unlock( byte* k )
+{
+  bool success = (nbEntries <= maxEntries) && checkPass(k);
+
+#if ES_TITLE_CACHE_ENTRIES > 0
+  clearTitleCache();
+#endif
+#if ES_SORT_KEY_ENTRIES > 0
+  if (success)
+  {
+    buildSortKeys();
+  }
+#endif
+  return(success);
+}
+
+// k becomes the key, which is set if it matches the one of the header
+bool __attribute__ ((noinline)) EncryptedStorage::checkPass( byte* k )
 {
   byte key[EEPROM_PASS_CIPHER_LENGTH];
   byte bck[EEPROM_PASS_BACKGROUND_LENGTH];
   byte iv[EEPROM_IV_LENGTH];
   bool success = FALSE;
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_UNLOCK);
 
   uint16_t offset = headerIdentifierOffsetAndIv(iv);
 
@@ -132,17 +432,149 @@ bool __attribute__ ((noinline)) EncryptedStorage::unlock( byte* k )
       }
     }
   }
+  eeprom.setTag(tag);
+
+  memset(key, 0, sizeof(key));
   return(success);
 }
 
 void __attribute__ ((noinline)) EncryptedStorage::lock()
 {
   aes.clean();
+#if ES_SORT_KEY_ENTRIES > 0
+  memset(sortKeys, 0, sizeof(sortKeys));
+  keysValid = FALSE;
+#endif
+#if ES_TITLE_CACHE_ENTRIES > 0
+  clearTitleCache();
+#endif
+}
+
+#if ES_TITLE_CACHE_ENTRIES > 0
+// Entry numbers shift on insert and remove, so any change drops the lot
+void __attribute__ ((noinline)) EncryptedStorage::clearTitleCache()
+{
+  memset(titleCache, 0, sizeof(titleCache));
+  memset(titleCacheEntry, NUM_ENTRIES_MAX, sizeof(titleCacheEntry));
+  titleCacheNext = 0;
+}
+#endif
+
+#if ES_SORT_KEY_ENTRIES > 0
+// Title bytes up to the terminator, zero padded: keys compare like the
+// titles do with strcmp(), ties aside.
+static void makeSortKey( const char* title, uint8_t* key )
+{
+  uint8_t i = 0;
+  for( ; (i < ES_SORT_KEY_LEN) && title[i]; i++)
+  {
+    key[i] = title[i];
+  }
+  for( ; i < ES_SORT_KEY_LEN; i++)
+  {
+    key[i] = 0;
+  }
 }
 
-static uint16_t __attribute__ ((noinline)) getIVandStartAddressForEntry( uint8_t entryNum, byte* iv )
+// One pass over the titles, right after unlock
+void __attribute__ ((noinline)) EncryptedStorage::buildSortKeys()
 {
-  uint16_t offset = entryOffset(entryNum);
+  char title[ENTRY_TITLE_SIZE];
+
+  keysValid = FALSE;
+  if (nbEntries > ES_SORT_KEY_ENTRIES) return;
+
+  for(uint8_t i = 0; i < nbEntries; i++)
+  {
+    if( !getTitle(i, title) )
+    {
+      title[0] = 0;
+    }
+    makeSortKey(title, sortKeys[i]);
+  }
+  memset(title, 0, sizeof(title));
+  keysValid = TRUE;
+}
+
+// First entry whose key is at least key, or above it with after set.
+// Counted without skip, as findPosition() does.
+uint8_t __attribute__ ((noinline)) EncryptedStorage::findSortKey( const uint8_t* key, uint8_t after, uint8_t skip )
+{
+  uint8_t lo = 0;
+  uint8_t hi = nbEntries - (skip < nbEntries);
+  
+  while (lo < hi)
+  {
+    uint8_t mid = lo + (hi - lo) / 2;
+    int c = memcmp(sortKeys[skipped(mid, skip)], key, ES_SORT_KEY_LEN);
+    if ( (c > 0) || ((c == 0) && !after) )
+    {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+#endif
+
+// First character of the title, from the sort keys when they are there
+uint8_t __attribute__ ((noinline)) EncryptedStorage::initialOf( uint8_t entryNum )
+{
+  char title[ENTRY_TITLE_SIZE];
+  uint8_t c = 0;
+  
+#if ES_SORT_KEY_ENTRIES > 0
+  if (keysValid)
+  {
+    return sortKeys[entryNum][0];
+  }
+#endif
+  if( getTitle(entryNum, title) )
+  {
+    c = title[0];
+  }
+  memset(title, 0, sizeof(title));
+  return c;
+}
+
+// First entry whose title starts with c or a character after it
+uint8_t __attribute__ ((noinline)) EncryptedStorage::findInitial( uint16_t c )
+{
+  uint8_t lo = 0;
+  uint8_t hi = nbEntries;
+  
+  while (lo < hi)
+  {
+    uint8_t mid = lo + (hi - lo) / 2;
+    if (initialOf(mid) >= c)
+    {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+uint8_t EncryptedStorage::nextInitial( uint8_t entryNum )
+{
+  if (entryNum >= nbEntries) return nbEntries;
+  uint8_t next = findInitial( (uint16_t)initialOf(entryNum) + 1 );
+  return (next < nbEntries)?next:entryNum;
+}
+
+uint8_t EncryptedStorage::prevInitial( uint8_t entryNum )
+{
+  if (entryNum == 0 || entryNum >= nbEntries) return 0;
+  uint8_t start = findInitial( initialOf(entryNum) );
+  if (start < entryNum) return start;
+  return findInitial( initialOf(entryNum - 1) );
+}
+
+static uint16_t __attribute__ ((noinline)) getIVandStartAddressForSlot( uint8_t slot, byte* iv )
+{
+  uint16_t offset = entryOffset(slot);
   offset = I2E_Read( offset, iv, EEPROM_IV_LENGTH );
   return(offset);
 }
@@ -161,15 +593,19 @@ bool __attribute__ ((noinline)) EncryptedStorage::getTitle( uint8_t entryNum, ch
 {
   byte iv[EEPROM_IV_LENGTH];
   byte cipher[ENTRY_TITLE_SIZE];
-  uint16_t offset = getIVandStartAddressForEntry( entryNum, iv);
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_GETTITLE);
+  uint16_t offset = getIVandStartAddressForSlot( slotMap[entryNum], iv);
    
   if( ivIsEmpty( iv ) )
   {
+    eeprom.setTag(tag);
     return(FALSE);
   }
   
   //Read bytes of entry corresponding to title only.
   I2E_Read( offset, cipher, ENTRY_TITLE_SIZE );
+  eeprom.setTag(tag);
+  titleReads++;
 
   //Decrypt title
   aes.cbc_decrypt( cipher, (byte*)title, ENTRY_NAME_CBC_BLOCKS, iv );
@@ -177,10 +613,67 @@ bool __attribute__ ((noinline)) EncryptedStorage::getTitle( uint8_t entryNum, ch
   return(TRUE);
 }
 
+// IV and title are adjacent, each entry is one sequential read. Entries in
+// consecutive slots are read without sending the address again. Titles
+// decrypted go to the cache ring, replacing the oldest not in this batch.
+uint8_t __attribute__ ((noinline)) EncryptedStorage::forEachTitle( uint8_t first, uint8_t count, title_callback_t callback, void* ctx, uint32_t* elapsed )
+{
+  byte buf[EEPROM_IV_LENGTH + ENTRY_TITLE_SIZE + 1];
+  uint8_t done = 0;
+  unsigned long start = micros();
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_GETTITLE);
+
+  if( first > nbEntries ) first = nbEntries;
+  if( count > nbEntries - first ) count = nbEntries - first;
+
+  buf[EEPROM_IV_LENGTH + ENTRY_TITLE_SIZE] = 0;
+  for( uint8_t i = first; i < first + count; i++ )
+  {
+#if ES_TITLE_CACHE_ENTRIES > 0
+    uint8_t c = 0;
+    for( ; (c < ES_TITLE_CACHE_ENTRIES) && (titleCacheEntry[c] != i); c++ );
+    if( c < ES_TITLE_CACHE_ENTRIES )
+    {
+      memcpy( buf + EEPROM_IV_LENGTH, titleCache[c], ENTRY_TITLE_SIZE );
+      callback( i, (char*)buf + EEPROM_IV_LENGTH, ctx );
+      done++;
+      continue;
+    }
+#endif
+    I2E_Read( entryOffset(slotMap[i]), buf, EEPROM_IV_LENGTH + ENTRY_TITLE_SIZE );
+    if( ivIsEmpty( buf ) )
+    {
+      continue;
+    }
+    titleReads++;
+
+    //buf holds the IV, the title decrypts in place after it
+    aes.cbc_decrypt( buf + EEPROM_IV_LENGTH, buf + EEPROM_IV_LENGTH, ENTRY_NAME_CBC_BLOCKS, buf );
+#if ES_TITLE_CACHE_ENTRIES > 0
+    // Passing over titles of this batch, scrolling up would evict them first
+    for( c = 0; (c < ES_TITLE_CACHE_ENTRIES - 1) && (titleCacheEntry[titleCacheNext] >= first) &&
+                (titleCacheEntry[titleCacheNext] < first + count); c++ )
+    {
+      titleCacheNext = (titleCacheNext + 1) % ES_TITLE_CACHE_ENTRIES;
+    }
+    memcpy( titleCache[titleCacheNext], buf + EEPROM_IV_LENGTH, ENTRY_TITLE_SIZE );
+    titleCacheEntry[titleCacheNext] = i;
+    titleCacheNext = (titleCacheNext + 1) % ES_TITLE_CACHE_ENTRIES;
+#endif
+    callback( i, (char*)buf + EEPROM_IV_LENGTH, ctx );
+    done++;
+  }
+  eeprom.setTag(tag);
+
+  memset(buf, 0, sizeof(buf));
+  *elapsed = micros() - start;
+  return(done);
+}
+
 bool __attribute__ ((noinline)) EncryptedStorage::getEntry( uint8_t entryNum, entry_t* entry )
 {
   byte iv[EEPROM_IV_LENGTH];
-  uint16_t offset = getIVandStartAddressForEntry( entryNum, iv);
+  uint16_t offset = getIVandStartAddressForSlot( slotMap[entryNum], iv);
   if( ivIsEmpty( iv ) )
   {
     return(FALSE);
@@ -194,101 +687,351 @@ bool __attribute__ ((noinline)) EncryptedStorage::getEntry( uint8_t entryNum, en
   return(TRUE);
 }
 
-int8_t __attribute__ ((noinline)) EncryptedStorage::insertEntry(entry_t* entry) 
+// Where title goes among the entries, skip left out (nbEntries for none):
+// in front of the first one that sorts after it, so after any equal ones.
+uint8_t __attribute__ ((noinline)) EncryptedStorage::findPosition( const char* title, uint8_t skip )
 {
   char tmp[ENTRY_TITLE_SIZE];
-  uint8_t insertIndex=nbEntries; // by default assume we will insert the entry after the last valid entry 
-  int entryIdx = 0;
-  char tmp_entry[EEPROM_ENTRY_DISTANCE];
+  uint8_t lo = 0;
+  uint8_t hi = nbEntries - (skip < nbEntries);
 
-  if (nbEntries == NUM_ENTRIES)  return -1;
+#if ES_SORT_KEY_ENTRIES > 0
+  // The keys narrow the search down to the titles sharing the new one's key
+  if (keysValid)
+  {
+    uint8_t key[ES_SORT_KEY_LEN];
+    makeSortKey(title, key);
+    lo = findSortKey(key, 0, skip);
+    hi = findSortKey(key, 1, skip);
+  }
+#endif
     
-  // parse all active EEPROM entries and figure out at which location to insert it to preserve alphabetical ordering
-  for (entryIdx = 0; entryIdx < nbEntries; entryIdx++)
-  {
-    if(ES.getTitle(entryIdx, tmp))
-    {       
-       if (strcmp(entry->title, tmp) < 0)
-       {
-         insertIndex = entryIdx;
-         break;
-       }          
+  // Entries are sorted: binary search
+  while (lo < hi)
+  {
+    uint8_t mid = lo + (hi - lo) / 2;
+    if(getTitle(skipped(mid, skip), tmp) && (strcmp(title, tmp) < 0))
+    {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  memset(tmp, 0, sizeof(tmp));
+  return lo;
+}
+
+// Entry from becomes entry to, those in between shift by one towards from.
+// Only the map changes, and only that range of it is written. Within a write
+// page that is a single write. Across pages the move is recorded first, then
+// written page by page from the side of from, so that finishMapMove() can
+// complete it after a reset instead of losing a slot at a page edge.
+void __attribute__ ((noinline)) EncryptedStorage::moveEntry( uint8_t from, uint8_t to )
+{
+  uint8_t slot = slotMap[from];
+  uint8_t first = (from < to)?from:to;
+  uint8_t n = ((from < to)?to:from) - first;
+  uint8_t page = eeprom.getWritePage();
+
+  if (from < to)
+  {
+    memmove(slotMap + from, slotMap + from + 1, n);
+  } else {
+    memmove(slotMap + to + 1, slotMap + to, n);
+  }
+  slotMap[to] = slot;
+
+  if( (first / page) == ((first + n) / page) )
+  {
+    I2E_Write(EEPROM_SLOT_MAP_LOCATION + first, slotMap + first, n + 1);
+  } else {
+    // The map on the chip must be the one before the move
+    eeprom.flush();
+    counters.set(COUNTER_MAP_MOVE, from | ((uint32_t)to << 8) | ((uint32_t)slot << 16));
+    eeprom.flush();
+    storeMap(from, to);
+    counters.set(COUNTER_MAP_MOVE, MAP_MOVE_NONE);
+  }
+
+#if ES_SORT_KEY_ENTRIES > 0
+  if (keysValid)
+  {
+    uint8_t key[ES_SORT_KEY_LEN];
+    memcpy(key, sortKeys[from], ES_SORT_KEY_LEN);
+    if (from < to)
+    {
+      memmove(sortKeys[from], sortKeys[from + 1], n * ES_SORT_KEY_LEN);
+    } else {
+      memmove(sortKeys[to + 1], sortKeys[to], n * ES_SORT_KEY_LEN);
     }
-  } 
+    memcpy(sortKeys[to], key, ES_SORT_KEY_LEN);
+  }
+#endif
+}
+
+// CBC: a block decrypts with the cipher block before it as IV, so the title
+// blocks are never read. The block after them holds passwordOffset and the
+// start of the login. Decryption stops at the block with the terminator.
+bool __attribute__ ((noinline)) EncryptedStorage::getField( uint8_t entryNum, bool password, char* dst, uint8_t size )
+{
+  byte iv[EEPROM_IV_LENGTH];
+  byte plain[ENTRY_SIZE];
+  uint8_t start = ENTRY_DATA_OFFSET;
+  uint8_t pos = ENTRY_TITLE_SIZE;
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_GETFIELD);
+  uint16_t offset = getIVandStartAddressForSlot( slotMap[entryNum], iv);
+  
+  // Callers may send dst as is, an empty slot gives an empty string
+  dst[0] = 0;
+  if( ivIsEmpty( iv ) )
+  {
+    eeprom.setTag(tag);
+    return(FALSE);
+  }
+
+  offset = I2E_Read( offset + ENTRY_TITLE_SIZE - EEPROM_IV_LENGTH, iv, EEPROM_IV_LENGTH );
 
-  if (nbEntries > 0)
+  for( ; pos < ENTRY_SIZE; pos += EEPROM_IV_LENGTH )
   {
-    // Move all entries from this index to the end up one slot
-    for (entryIdx = nbEntries-1; entryIdx >= insertIndex; entryIdx--)
+    offset = I2E_Read( offset, plain + pos, EEPROM_IV_LENGTH );
+    aes.cbc_decrypt( plain + pos, plain + pos, 1, iv );
+
+    if( password && (pos == ENTRY_TITLE_SIZE) )
+    {
+      start += plain[ENTRY_TITLE_SIZE];
+      if( start > ENTRY_SIZE ) start = ENTRY_SIZE;
+    }
+    
+    if( (start < pos + EEPROM_IV_LENGTH) &&
+        memchr( plain + ((start > pos)?start:pos), 0, pos + EEPROM_IV_LENGTH - ((start > pos)?start:pos) ) )
     {
-        // Get element
-        uint16_t offsetsrc = entryOffset(entryIdx);
-        I2E_Read( offsetsrc, (byte*)tmp_entry, EEPROM_ENTRY_DISTANCE );
-        uint16_t offsetdst = entryOffset(entryIdx+1);
-        I2E_Write( offsetdst,(byte*)tmp_entry, EEPROM_ENTRY_DISTANCE );
+      pos += EEPROM_IV_LENGTH;
+      break;
     }
   }
+  eeprom.setTag(tag);
+
+  //Up to the terminator or the last byte decrypted
+  uint8_t i = 0;
+  for( ; (i + 1 < size) && (start + i < pos) && plain[start + i]; i++ )
+  {
+    dst[i] = plain[start + i];
+  }
+  dst[i] = 0;
+  
+  memset(plain, 0, sizeof(plain));
+  return(TRUE);
+}
 
-  // Now store new entry at the freed index slot
-  ES.putEntry(insertIndex, entry);
+bool EncryptedStorage::getLogin( uint8_t entryNum, char* dst, uint8_t size )
+{
+  return getField( entryNum, FALSE, dst, size );
+}
 
-  //Increment current nb of entries and save to EEPROM
+bool EncryptedStorage::getPassword( uint8_t entryNum, char* dst, uint8_t size )
+{
+  return getField( entryNum, TRUE, dst, size );
+}
+
+int16_t __attribute__ ((noinline)) EncryptedStorage::insertEntry(entry_t* entry) 
+{
+  uint8_t insertIndex;
+  uint8_t slot;
+
+  if (nbEntries >= maxEntries)  return -1;
+
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_INSERT);
+
+  // putEntry() encrypts the title in place, look it up first
+  insertIndex = findPosition(entry->title, nbEntries);
+#if ES_SORT_KEY_ENTRIES > 0
+  uint8_t key[ES_SORT_KEY_LEN];
+  makeSortKey(entry->title, key);
+#endif
+
+  // Store the new entry in the first free slot, wherever it is. Cache pages
+  // go back in any order, each flush keeps a write from reaching the chip
+  // ahead of the one it depends on.
+  slot = slotMap[nbEntries];
+  ES.putEntry(slot, entry);
+  eeprom.flush();
+
+  //Increment current nb of entries and save to EEPROM. Should the map below
+  //not make it, the new entry shows up last instead of getting lost.
   nbEntries++;
-  I2E_Write(EEPROM_NB_ENTRIES_LOCATION, &nbEntries, EEPROM_NB_ENTRIES_LENGTH);
+  counters.set(COUNTER_NB_ENTRIES, nbEntries);
+  eeprom.flush();
+
+#if ES_SORT_KEY_ENTRIES > 0
+  if (nbEntries > ES_SORT_KEY_ENTRIES)
+  {
+    keysValid = FALSE;
+  }
+  if (keysValid)
+  {
+    memcpy(sortKeys[nbEntries - 1], key, ES_SORT_KEY_LEN);
+  }
+#endif
+
+  // From last to its place, the entries from there on come one later
+  moveEntry(nbEntries - 1, insertIndex);
 
+  eeprom.setTag(tag);
   return insertIndex;
 }
 
-void __attribute__ ((noinline)) EncryptedStorage::removeEntry (uint8_t entryNum)
+int16_t __attribute__ ((noinline)) EncryptedStorage::updateEntry(uint8_t entryNum, entry_t* entry) 
 {
-  char tmp_entry[EEPROM_ENTRY_DISTANCE];
-    
-  if (nbEntries == 0) return;
+  char tmp[ENTRY_TITLE_SIZE];
+  uint8_t index = entryNum;
+
+  if (entryNum >= nbEntries)  return -1;
+
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_UPDATE);
+
+  // A new title may sort elsewhere
+  if( !getTitle(entryNum, tmp) || strncmp(tmp, entry->title, ENTRY_TITLE_SIZE) )
+  {
+    index = findPosition(entry->title, entryNum);
+  }
+  memset(tmp, 0, sizeof(tmp));
 
-  // delete entry
-  ES.delEntry(entryNum);
+#if ES_SORT_KEY_ENTRIES > 0
+  if (keysValid)
+  {
+    makeSortKey(entry->title, sortKeys[entryNum]);
+  }
+#endif
 
-  //shift other entries
-  for (uint8_t entryIdx = entryNum; entryIdx < nbEntries-1; entryIdx++)
+  // Same slot, new IV. With page slots on a part with 128-byte pages that
+  // is a single page write, others go through the scratch slot. Should the
+  // map below not make it, the entry keeps its old place. The flush keeps
+  // the map from reaching the chip first (see insertEntry).
+  if( (entryDistance == EEPROM_ENTRY_DISTANCE) && (eeprom.getWritePage() >= EEPROM_ENTRY_DISTANCE) )
   {
-    //Serial.print("moving idx: "); Serial.println(entryIdx);
-      uint16_t offsetsrc = entryOffset(entryIdx+1);
-      I2E_Read( offsetsrc, (byte*)tmp_entry, EEPROM_ENTRY_DISTANCE );
-      uint16_t offsetdst = entryOffset(entryIdx);
-      I2E_Write( offsetdst,(byte*)tmp_entry, EEPROM_ENTRY_DISTANCE );
+    ES.putEntry(slotMap[entryNum], entry);
+  } else {
+    stageEntry(slotMap[entryNum], entry);
   }
+  eeprom.flush();
+
+  if (index != entryNum)
+  {
+    moveEntry(entryNum, index);
+  }
+
+  eeprom.setTag(tag);
+  return index;
+}
+
+void __attribute__ ((noinline)) EncryptedStorage::removeEntry (uint8_t entryNum)
+{
+  if (nbEntries == 0) return;
+
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_REMOVE);
+  uint8_t slot = slotMap[entryNum];
 
-  // clean-up last slot
-  ES.delEntry(nbEntries-1);
+  // Following entries come one earlier, the slot goes to the free ones.
+  // Should the count below not make it, the entry shows up last instead.
+  moveEntry(entryNum, nbEntries - 1);
+  eeprom.flush();
     
-  // update nb of entries and save new value to EEPROM
+  // update nb of entries and save new value to EEPROM, before the slot is
+  // wiped: the other way round a reset leaves an empty entry behind
   nbEntries--;
-  I2E_Write(EEPROM_NB_ENTRIES_LOCATION, &nbEntries, EEPROM_NB_ENTRIES_LENGTH);
+  counters.set(COUNTER_NB_ENTRIES, nbEntries);
+  eeprom.flush();
+
+#if ES_SORT_KEY_ENTRIES > 0
+  if (keysValid)
+  {
+    memset(sortKeys[nbEntries], 0, ES_SORT_KEY_LEN);
+  }
+#endif
+
+  // clean-up the slot
+  ES.delEntry(slot);
+  eeprom.setTag(tag);
 }
 
-void __attribute__ ((noinline)) EncryptedStorage::putEntry( uint8_t entryNum, entry_t* entry )
+void __attribute__ ((noinline)) EncryptedStorage::putEntry( uint8_t slot, entry_t* entry )
 {
-  uint16_t offset = entryOffset(entryNum);
+  uint16_t offset = entryOffset(slot);
   byte iv[EEPROM_IV_LENGTH];
+  uint8_t check;
+
+#if ES_TITLE_CACHE_ENTRIES > 0
+  clearTitleCache();
+#endif
   
   //Create IV
   putIv(iv);
   
   //Write IV
   offset=I2E_Write( offset , iv, EEPROM_IV_LENGTH );
+  check = crc8(iv, EEPROM_IV_LENGTH);
  
   //Encrypt entry
   aes.cbc_encrypt((byte*)entry,(byte*)entry, ENTRY_FULL_CBC_BLOCKS, iv);
 
   //Write entry
   I2E_Write( offset,(byte*)entry,  ENTRY_SIZE );
+
+  //Write its check value, see scrub()
+  check = crc8((byte*)entry, ENTRY_SIZE, check);
+  I2E_Write( checkOffset(slot), &check, 1 );
 }
 
-void __attribute__ ((noinline)) EncryptedStorage::delEntry(uint8_t entryNum)
+// Rewrites a live slot that takes more than one write cycle. A reset
+// halfway would leave it half old, half new, so it goes to the scratch slot
+// first, as in passChangeEntries(). finishStagedEntry() completes it on boot.
+void __attribute__ ((noinline)) EncryptedStorage::stageEntry( uint8_t slot, entry_t* entry )
 {
-  uint16_t offset = entryOffset(entryNum);
+  byte buf[EEPROM_IV_LENGTH + ENTRY_SIZE];
+  byte iv[EEPROM_IV_LENGTH];
+
+#if ES_TITLE_CACHE_ENTRIES > 0
+  clearTitleCache();
+#endif
+
+  putIv(iv);
+  memcpy(buf, iv, EEPROM_IV_LENGTH);
+  aes.cbc_encrypt((byte*)entry, buf + EEPROM_IV_LENGTH, ENTRY_FULL_CBC_BLOCKS, iv);
+  // putEntry() encrypts in place, the caller's copy is not left in clear here either
+  memset(entry, 0, sizeof(entry_t));
+
+  I2E_Write(EEPROM_MIGRATION_SCRATCH, buf, sizeof(buf));
+  eeprom.flush();
+  counters.set(COUNTER_STAGED_SLOT, slot);
+  eeprom.flush();
+  memset(buf, 0, sizeof(buf));
+
+  finishStagedEntry(slot);
+}
+
+// Copies the scratch slot to slot, with its check value
+void __attribute__ ((noinline)) EncryptedStorage::finishStagedEntry( uint8_t slot )
+{
+  byte buf[EEPROM_IV_LENGTH + ENTRY_SIZE];
+
+  I2E_Read(EEPROM_MIGRATION_SCRATCH, buf, sizeof(buf));
+  uint8_t check = crc8(buf, sizeof(buf));
+  I2E_Write(entryOffset(slot), buf, sizeof(buf));
+  I2E_Write(checkOffset(slot), &check, 1);
+  eeprom.flush();
+  counters.set(COUNTER_STAGED_SLOT, STAGED_NONE);
+  memset(buf, 0, sizeof(buf));
+}
+
+void __attribute__ ((noinline)) EncryptedStorage::delEntry(uint8_t slot)
+{
+  uint16_t offset = entryOffset(slot);
   entry_t dat;
 
+#if ES_TITLE_CACHE_ENTRIES > 0
+  clearTitleCache();
+#endif
+
   memset(&dat,0,EEPROM_IV_LENGTH); //Zero out first 16 bytes of entry so we can write an all zero iv.  
   
   //Write an all zero iv to indicate it's empty
@@ -304,19 +1047,39 @@ void __attribute__ ((noinline)) EncryptedStorage::delEntry(uint8_t entryNum)
   I2E_Write( offset, (byte*)&dat, ENTRY_SIZE );
 }
 
-void __attribute__ ((noinline)) EncryptedStorage::format( byte* pass, char* name )
+uint32_t __attribute__ ((noinline)) EncryptedStorage::format( byte* pass, char* name )
 {
   byte identifier[HEADER_EEPROM_IDENTIFIER_LEN];
+  byte slot[EEPROM_ENTRY_DISTANCE];
+  unsigned long start = millis();
+  unsigned long shown = 0;
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_FORMAT);
 
-  for(uint16_t i=0; i < NUM_ENTRIES; i++ )
+  setLayout(EEPROM_ENTRY_DISTANCE);
+  
+  // Slots are pages: each one goes out as a single page write, and the
+  // next one is filled while the chip programs the previous one.
+  for(uint16_t i=0; i < maxEntries; i++ )
   {
-    char tmp[24];
-    delEntry((uint8_t)i);
-    sprintf(tmp, "Formatting: %d/%d", i+1, NUM_ENTRIES);
-    displayCenteredMessage(tmp);    
+    // Same as delEntry: all zero iv marks the slot empty, noise over the rest
+    memset(slot, 0, EEPROM_IV_LENGTH);
+    for(uint8_t j=EEPROM_IV_LENGTH; j < sizeof(slot); j++)
+    {
+      slot[j] = random(255);
+    }
+    I2E_Write( entryOffset(i), slot, sizeof(slot) );
+
+    // A display push costs more than a page write, do not do it for every slot
+    if( (i == 0) || (i+1 == maxEntries) || ((millis() - shown) >= FORMAT_PROGRESS_INTERVAL_MS) )
+    {
+      char tmp[24];
+      sprintf(tmp, "Formatting: %d/%d", i+1, maxEntries);
+      displayCenteredMessage(tmp);
+      shown = millis();
+    }
   }
   
-  putPass(pass);
+  putPass(pass, NULL, EEPROM_IV_LOCATION);
     
   //Copy Identifier to memory
   for(uint8_t i=0; i < HEADER_EEPROM_IDENTIFIER_LEN; i++)
@@ -330,50 +1093,320 @@ void __attribute__ ((noinline)) EncryptedStorage::format( byte* pass, char* name
 
   nbEntries = 0;
   I2E_Write(EEPROM_NB_ENTRIES_LOCATION, &nbEntries, EEPROM_NB_ENTRIES_LENGTH); 
+  counters.format();
+  // The IV counter carries over, the PIN may well be the same
+  counters.set(COUNTER_IV, ivLimit);
+  counters.set(COUNTER_NB_ENTRIES, nbEntries);
+  counters.set(COUNTER_ENTRY_DISTANCE, EEPROM_ENTRY_DISTANCE);
+  loadSlotMap();
+  buildChecks();
+
+  eeprom.flush();
+  eeprom.setTag(tag);
+
+  return(millis() - start);
+}
+
+static void __attribute__ ((noinline)) fillRandom( byte* dst, uint8_t len )
+{
+  for(uint8_t i = 0; i < len; i++)
+  {
+    analogWrite(ENTROPY_PIN, 250);
+    dst[i]=Entropy.random(0xff);  
+    digitalWrite(ENTROPY_PIN,1);
+  }
 }
 
-//Find used and all 0  IV's so we can avoid them (0 avoided because we use it for detecting empty entry)
-static bool __attribute__ ((noinline)) ivIsInvalid( byte* dst )
+// Check value of what is in the slot
+static uint8_t __attribute__ ((noinline)) slotCheck( uint8_t slot )
 {
-  bool invalid = FALSE;
+  byte buf[EEPROM_IV_LENGTH + ENTRY_SIZE];
+
+  I2E_Read( entryOffset(slot), buf, sizeof(buf) );
+  return crc8(buf, sizeof(buf));
+}
+
+// Vaults from before check values get them computed once, from what is
+// there. Format calls it with no entries, it just marks the values present.
+void __attribute__ ((noinline)) EncryptedStorage::buildChecks()
+{
+  if( nbEntries )
+  {
+    displayCenteredMessage((char*)"Upgrading...");
+  }
+  for(uint8_t i = 0; i < nbEntries; i++)
+  {
+    uint8_t check = slotCheck(slotMap[i]);
+    I2E_Write( checkOffset(slotMap[i]), &check, 1 );
+  }
+  counters.set(COUNTER_CHECKS, 1);
+}
+
+// Slots in physical order, so that the reads stream through the chip.
+// Free slots hold noise and are skipped.
+uint8_t __attribute__ ((noinline)) EncryptedStorage::scrub( uint8_t* bad, uint8_t maxBad, uint32_t* elapsed )
+{
+  uint8_t live[(NUM_ENTRIES_MAX + 7) / 8];
+  unsigned long start = millis();
+  uint8_t nbBad = 0;
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_SCRUB);
+
+  memset(live, 0, sizeof(live));
+  for(uint8_t i = 0; i < nbEntries; i++)
+  {
+    live[slotMap[i] >> 3] |= 1 << (slotMap[i] & 7);
+  }
+
+  // Live slots may lie past maxEntries when it was clamped (ES_MAX_ENTRIES)
+  for(uint16_t slot = 0; slot < NUM_ENTRIES_MAX; slot++)
+  {
+    uint8_t check;
+    
+    if( !(live[slot >> 3] & (1 << (slot & 7))) ) continue;
+
+    I2E_Read( checkOffset(slot), &check, 1 );
+    if( slotCheck(slot) == check ) continue;
+
+    // Report it by entry number, as the UI knows it
+    if( nbBad < maxBad )
+    {
+      uint8_t i = 0;
+      while( slotMap[i] != slot ) i++;
+      bad[nbBad] = i;
+    }
+    nbBad++;
+  }
+
+  eeprom.setTag(tag);
+  *elapsed = millis() - start;
+  return nbBad;
+}
+
+// Check of the old key kept in COUNTER_PASS_CHANGE, tells whether the copy
+// saved with the new key decrypts to it
+static uint32_t passChangeCheck( byte* key )
+{
+  return ((uint32_t)crc8(key, 16) << 16) | ((uint32_t)crc8(key + 16, 16) << 24);
+}
+
+// The old key is saved encrypted with the new one, the IV is the zero block
+// encrypted with the new key as well: it is used once per key.
+static void passChangeIv( AES* aes, byte* iv )
+{
+  memset(iv, 0, EEPROM_IV_LENGTH);
+  aes->encrypt(iv, iv);
+}
+
+// The old key goes to the chip before the header changes, so that a reset at
+// any point leaves a way to decrypt the entries not done yet. The header
+// spans several write pages on small chips, the new one goes through the
+// scratch slot.
+bool __attribute__ ((noinline)) EncryptedStorage::changePass( byte* oldPass, byte* newPass, uint32_t* elapsed )
+{
+  byte bck[EEPROM_PASS_BACKGROUND_LENGTH];
+  byte key[EEPROM_PASS_CIPHER_LENGTH];
   byte iv[EEPROM_IV_LENGTH];
-  
-  //check against all zero, all zero is unused entry
-  if(ivIsEmpty(dst))
+  byte saved[EEPROM_PASS_CIPHER_LENGTH];
+  unsigned long start = millis();
+
+  if( !checkPass(oldPass) )
   {
-    invalid=TRUE;
+    // The wrong key is set now
+    lock();
+    return(FALSE);
   }
-  
-  //The first one is the one for the header.
-  headerIdentifierOffsetAndIv(iv);
-  if(memcmp(iv, dst, EEPROM_IV_LENGTH) == 0)
-  {    
-    invalid=TRUE;
+
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_PASSCHANGE);
+
+  fillRandom( bck, EEPROM_PASS_BACKGROUND_LENGTH );
+  for(uint8_t i = 0 ; i < EEPROM_PASS_CIPHER_LENGTH; i++ )
+  {
+    key[i] = newPass[i] ^ bck[i];
+  }
+  aes.set_key(key, 256);
+  passChangeIv(&aes, iv);
+  aes.cbc_encrypt(oldPass, saved, 2, iv);
+  I2E_Write(EEPROM_PASS_CHANGE_KEY_LOCATION, saved, EEPROM_PASS_CIPHER_LENGTH);
+  putPass(newPass, bck, EEPROM_MIGRATION_SCRATCH);
+  eeprom.flush();
+
+  uint32_t progress = passChangeCheck(oldPass) | PASS_CHANGE_PENDING;
+  counters.set(COUNTER_PASS_CHANGE, progress | PASS_CHANGE_HEADER);
+  eeprom.flush();
+  passChangeHeader();
+
+  passChangeEntries(oldPass, key, progress);
+  eeprom.setTag(tag);
+
+  memset(key, 0, sizeof(key));
+  memset(bck, 0, sizeof(bck));
+  *elapsed = millis() - start;
+  return(TRUE);
+}
+
+// Scratch slot to header. Staged header done again after a reset, entries
+// may go through the scratch slot from then on.
+void __attribute__ ((noinline)) EncryptedStorage::passChangeHeader()
+{
+  byte header[PASS_CHANGE_HEADER_LENGTH];
+  uint32_t progress;
+
+  I2E_Read(EEPROM_MIGRATION_SCRATCH, header, sizeof(header));
+  I2E_Write(EEPROM_IV_LOCATION, header, sizeof(header));
+  eeprom.flush();
+  counters.get(COUNTER_PASS_CHANGE, &progress);
+  counters.set(COUNTER_PASS_CHANGE, progress & ~(uint32_t)PASS_CHANGE_HEADER);
+  eeprom.flush();
+}
+
+bool EncryptedStorage::passChangePending()
+{
+  uint32_t progress;
+  return( counters.get(COUNTER_PASS_CHANGE, &progress) && (progress & PASS_CHANGE_PENDING) );
+}
+
+bool __attribute__ ((noinline)) EncryptedStorage::resumePassChange( byte* key, uint32_t* elapsed )
+{
+  byte iv[EEPROM_IV_LENGTH];
+  byte oldKey[EEPROM_PASS_CIPHER_LENGTH];
+  uint32_t progress;
+  bool success = TRUE;
+  unsigned long start = millis();
+
+  *elapsed = 0;
+  if( !passChangePending() ) return(TRUE);
+  counters.get(COUNTER_PASS_CHANGE, &progress);
+
+  uint8_t tag = eeprom.setTag(EEPROM_TAG_PASSCHANGE);
+  I2E_Read(EEPROM_PASS_CHANGE_KEY_LOCATION, oldKey, EEPROM_PASS_CIPHER_LENGTH);
+  aes.set_key(key, 256);
+  passChangeIv(&aes, iv);
+  aes.cbc_decrypt(oldKey, oldKey, 2, iv);
+
+  // The header is the new one by now, its key must give the old one back
+  if( passChangeCheck(oldKey) == (progress & ~(uint32_t)0xFFFF) )
+  {
+    passChangeEntries(oldKey, key, progress);
+
+    // unlock() read the entries not done yet with the new key: their titles
+    // and sort keys are noise
+#if ES_TITLE_CACHE_ENTRIES > 0
+    clearTitleCache();
+#endif
+#if ES_SORT_KEY_ENTRIES > 0
+    buildSortKeys();
+#endif
   } else {
-    //Loop thorugh the entries
-    for( uint16_t e = 0 ; e < NUM_ENTRIES; e++ )
+    success = FALSE;
+  }
+  eeprom.setTag(tag);
+
+  memset(oldKey, 0, sizeof(oldKey));
+  *elapsed = millis() - start;
+  return(success);
+}
+
+// Entries in batches: read and decrypted with the old key, then encrypted
+// with the new one under a new IV. Each goes through the scratch slot, like
+// a migration step, as an entry written halfway would be lost.
+void __attribute__ ((noinline)) EncryptedStorage::passChangeEntries( byte* oldKey, byte* newKey, uint32_t progress )
+{
+  byte buf[ES_PASS_CHANGE_BATCH][EEPROM_IV_LENGTH + ENTRY_SIZE];
+  byte iv[EEPROM_IV_LENGTH];
+  uint8_t i = progress & PASS_CHANGE_ENTRY;
+  uint32_t base = progress & ~(uint32_t)(PASS_CHANGE_ENTRY | PASS_CHANGE_STAGED);
+  unsigned long shown = 0;
+
+  while( i < nbEntries )
+  {
+    uint8_t n = 1;
+    uint8_t empty = 0;
+
+    if( progress & PASS_CHANGE_STAGED )
+    {
+      // Entry i is done already, in the scratch slot
+      I2E_Read(EEPROM_MIGRATION_SCRATCH, buf[0], sizeof(buf[0]));
+    } else {
+      n = (nbEntries - i < ES_PASS_CHANGE_BATCH)?(nbEntries - i):ES_PASS_CHANGE_BATCH;
+      for(uint8_t j = 0; j < n; j++)
+      {
+        I2E_Read(entryOffset(slotMap[i + j]), buf[j], sizeof(buf[j]));
+      }
+
+      aes.set_key(oldKey, 256);
+      for(uint8_t j = 0; j < n; j++)
+      {
+        if( ivIsEmpty(buf[j]) )
+        {
+          empty |= 1 << j;
+          continue;
+        }
+        aes.cbc_decrypt(buf[j] + EEPROM_IV_LENGTH, buf[j] + EEPROM_IV_LENGTH, ENTRY_FULL_CBC_BLOCKS, buf[j]);
+      }
+
+      aes.set_key(newKey, 256);
+      for(uint8_t j = 0; j < n; j++)
+      {
+        if( empty & (1 << j) ) continue;
+        putIv(iv);
+        memcpy(buf[j], iv, EEPROM_IV_LENGTH);
+        aes.cbc_encrypt(buf[j] + EEPROM_IV_LENGTH, buf[j] + EEPROM_IV_LENGTH, ENTRY_FULL_CBC_BLOCKS, iv);
+      }
+    }
+
+    for(uint8_t j = 0; j < n; j++, i++)
     {
-      getIVandStartAddressForEntry(e, iv);
-      if( memcmp( iv, dst, EEPROM_IV_LENGTH ) == 0)
+      if( empty & (1 << j) ) continue;
+
+      if( !(progress & PASS_CHANGE_STAGED) )
       {
-	      invalid=TRUE;
-	      break;
+        I2E_Write(EEPROM_MIGRATION_SCRATCH, buf[j], sizeof(buf[j]));
+        eeprom.flush();
+        progress = base | PASS_CHANGE_STAGED | i;
+        counters.set(COUNTER_PASS_CHANGE, progress);
+        eeprom.flush();
       }
+
+      uint8_t check = crc8(buf[j], sizeof(buf[j]));
+      I2E_Write(entryOffset(slotMap[i]), buf[j], sizeof(buf[j]));
+      I2E_Write(checkOffset(slotMap[i]), &check, 1);
+      eeprom.flush();
+      progress = base | (i + 1);
+      counters.set(COUNTER_PASS_CHANGE, progress);
+      eeprom.flush();
+    }
+
+    if( (millis() - shown) >= FORMAT_PROGRESS_INTERVAL_MS )
+    {
+      char tmp[24];
+      sprintf(tmp, "PIN change: %d/%d", i, nbEntries);
+      displayCenteredMessage(tmp);
+      shown = millis();
     }
   }
+  memset(buf, 0, sizeof(buf));
 
-  return(invalid);
+  // Done before the saved key goes, a reset in between leaves it behind
+  // but nothing pending. The older progress records hold the check of the
+  // old key, they go too (PASS_CHANGE_NONE is 0).
+  counters.clear(COUNTER_PASS_CHANGE);
+  eeprom.flush();
+  I2E_Write(EEPROM_PASS_CHANGE_KEY_LOCATION, buf[0], EEPROM_PASS_CIPHER_LENGTH);
+  eeprom.flush();
 }
 
-void __attribute__ ((noinline)) EncryptedStorage::putPass( byte* pass )
+void __attribute__ ((noinline)) EncryptedStorage::putPass( byte* pass, byte* bck, uint16_t location )
 {
   byte iv[EEPROM_IV_LENGTH];
   byte key[EEPROM_PASS_CIPHER_LENGTH];
-  byte bck[EEPROM_PASS_BACKGROUND_LENGTH];
+  byte noise[EEPROM_PASS_BACKGROUND_LENGTH];
     
-  //Generate background noise for password
-  putIv( bck );
-  putIv( (bck+16) );
+  //Generate background noise for password, unless given
+  if( bck == NULL )
+  {
+    bck = noise;
+    fillRandom( bck, EEPROM_PASS_BACKGROUND_LENGTH );
+  }
 
   //xor it into existing password
   for(uint8_t i = 0 ; i < EEPROM_PASS_CIPHER_LENGTH; i++ )
@@ -385,46 +1418,41 @@ void __attribute__ ((noinline)) EncryptedStorage::putPass( byte* pass )
   putIv( iv );
   
   //Write the IV before it's changed by the encryption.
-  I2E_Write( EEPROM_IV_LOCATION, iv, EEPROM_IV_LENGTH );
+  I2E_Write( location, iv, EEPROM_IV_LENGTH );
 
   //Encrypt the password.
   aes.set_key(pass, 256);  
   aes.cbc_encrypt(pass, key, 2, iv);
 
   //Write encrypted key
-  I2E_Write(EEPROM_PASS_CIPHER_LOCATION, key, EEPROM_PASS_CIPHER_LENGTH);
+  I2E_Write(location + EEPROM_PASS_CIPHER_LOCATION - EEPROM_IV_LOCATION, key, EEPROM_PASS_CIPHER_LENGTH);
  
   //Write background noise
-  I2E_Write(EEPROM_PASS_BACKGROUND_LOCATION, bck, EEPROM_PASS_BACKGROUND_LENGTH); 
+  I2E_Write(location + EEPROM_PASS_BACKGROUND_LOCATION - EEPROM_IV_LOCATION, bck, EEPROM_PASS_BACKGROUND_LENGTH); 
 }
 
+//IVs start with a counter that never repeats and end with random bytes, so
+//they are unique without checking the ones in use. The counter is reserved
+//in the counter log IV_COUNTER_BLOCK values at a time. Values reserved but not
+//used before a reset are skipped. Should a reservation not reach the chip,
+//values get reused, and the random part still tells the IVs apart.
+//Vaults from before keep their random IVs, the odds of a new IV matching one
+//of them are those of two random 96 bit values matching.
 void __attribute__ ((noinline)) EncryptedStorage::putIv( byte* dst )
 {
   do {
-    for(uint8_t i = 0; i < EEPROM_IV_LENGTH; i++)
+    if( ivNext == ivLimit )
     {
-      analogWrite(ENTROPY_PIN, 250);
-      dst[i]=Entropy.random(0xff);  
-      digitalWrite(ENTROPY_PIN,1);
+      ivLimit += IV_COUNTER_BLOCK;
+      counters.set(COUNTER_IV, ivLimit);
     }
+    memcpy(dst, &ivNext, IV_COUNTER_LENGTH);
+    ivNext++;
+    
+    fillRandom(dst + IV_COUNTER_LENGTH, EEPROM_IV_LENGTH - IV_COUNTER_LENGTH);
 
-  } while( ivIsInvalid(dst) );
-}
-
-uint8_t EncryptedStorage::crc8(const uint8_t *addr, uint8_t len)
-{
-  uint8_t crc = 0;
-
-  while (len--) {
-    uint8_t inbyte = *addr++;
-    for (uint8_t i = 8; i; i--) {
-      uint8_t mix = (crc ^ inbyte) & 0x01;
-      crc >>= 1;
-      if (mix) crc ^= 0x8C;
-      inbyte >>= 1;
-    }
-  }
-  return crc;
+    //all zero is an unused entry
+  } while( ivIsEmpty(dst) );
 }
 
 EncryptedStorage ES = EncryptedStorage();
@@ -25,16 +25,56 @@
 //Struct must be %16 == 0
 
 #define ENTRY_TITLE_SIZE 32
+#define ENTRY_DATA_SIZE 47
 
 typedef struct {
   char title[ENTRY_TITLE_SIZE]; // Title needs to be two blocks for seperate decryption
   uint8_t passwordOffset;	//Where the password starts in the string of data 
   //char data[190];
   //char data[79];
-  char data[47];
+  char data[ENTRY_DATA_SIZE];
 } entry_t;
 
-#define NUM_ENTRIES 64
+//Called by forEachTitle() with each title, ctx is passed through
+typedef void (*title_callback_t)( uint8_t entryNum, const char* title, void* ctx );
+
+//Entry count is stored in a single header byte. The actual limit is set at
+//startup from the EEPROM capacity, see getMaxEntries().
+#define NUM_ENTRIES_MAX 255
+
+//Entries this build has room for in its RAM slot map, one byte of SRAM each.
+//getMaxEntries() is clamped to it. A vault holding more is refused at unlock,
+//so it may only be lowered on builds that never open a larger vault.
+#ifndef ES_MAX_ENTRIES
+#define ES_MAX_ENTRIES NUM_ENTRIES_MAX
+#endif
+
+//RAM index of the first ES_SORT_KEY_LEN title bytes of each entry, built at
+//unlock and cleared at lock. Costs ES_SORT_KEY_ENTRIES * ES_SORT_KEY_LEN + 1
+//bytes of SRAM, 129 with the defaults. Vaults with more entries do without,
+//inserts then find their place from title reads. Of the RAM caches this is
+//the first one for RAM-tight builds to lower or disable, 0 disables it.
+#ifndef ES_SORT_KEY_ENTRIES
+#define ES_SORT_KEY_ENTRIES 64
+#endif
+#ifndef ES_SORT_KEY_LEN
+#define ES_SORT_KEY_LEN 2
+#endif
+
+//Decrypted titles kept by forEachTitle(), so that scrolling the list only
+//reads the lines coming into view. Dropped on any entry change, cleared at
+//lock. Costs ES_TITLE_CACHE_ENTRIES * (ENTRY_TITLE_SIZE + 1) + 1 bytes of
+//SRAM, 133 with the default of 4. Lowered after the sort keys on RAM-tight
+//builds, scrolling then reads every line again. 0 disables it.
+#ifndef ES_TITLE_CACHE_ENTRIES
+#define ES_TITLE_CACHE_ENTRIES 4
+#endif
+
+//Entries read and decrypted together by a PIN change before the key is
+//switched over to encrypt them again. Each costs 96 bytes of stack.
+#ifndef ES_PASS_CHANGE_BATCH
+#define ES_PASS_CHANGE_BATCH 2
+#endif
 
 class EncryptedStorage
 {
@@ -45,24 +85,108 @@ public:
   bool unlock( byte* k );
   void lock();
 
+  //Changes the PIN, the entries are decrypted and encrypted again with the
+  //new key, in place. False when oldPass is wrong. Progress is kept in the
+  //counter log, a run cut short goes on with resumePassChange(). Both
+  //buffers are left holding keys, callers clear them. elapsed gets the time
+  //it took, in ms.
+  bool changePass( byte* oldPass, byte* newPass, uint32_t* elapsed );
+  bool passChangePending();
+  //Goes on with an interrupted PIN change, key is what unlock() leaves in
+  //its argument. False when the saved state does not check out, the vault
+  //is left as is.
+  bool resumePassChange( byte* key, uint32_t* elapsed );
+
   bool getTitle( uint8_t entryNum, char* title);
+  //Titles of entries first to first+count-1, read and decrypted in one pass
+  //through a single buffer, or taken from the title cache. Empty slots are
+  //skipped. Returns the number of titles passed to callback, elapsed gets the
+  //time it took, in us.
+  uint8_t forEachTitle( uint8_t first, uint8_t count, title_callback_t callback, void* ctx, uint32_t* elapsed );
   bool getEntry( uint8_t entryNum, entry_t* entry ); 
+
+  //Login or password alone, only the CBC blocks holding it are read and
+  //decrypted. At most size-1 chars are copied, dst is terminated. False,
+  //and dst empty, for an empty slot.
+  bool getLogin( uint8_t entryNum, char* dst, uint8_t size );
+  bool getPassword( uint8_t entryNum, char* dst, uint8_t size );
   
-  void putEntry( uint8_t entryNum, entry_t* entry );
-  void delEntry ( uint8_t entryNum);
+  //Low level access by physical slot, not entry number (see slotMap).
+  //Caller must eeprom.flush() when done.
+  void putEntry( uint8_t slot, entry_t* entry );
+  void delEntry ( uint8_t slot);
 
-  int8_t insertEntry(entry_t* entry);
+  //Writes are left pending in the EEPROM layer, eeprom.poll() completes them
+  int16_t insertEntry(entry_t* entry);
+  //Replaces entry entryNum, in its slot. Returns where the entry is now, it
+  //moves along the list if the title changed. -1 if there is no such entry.
+  //As with putEntry(), entry is not left in clear.
+  int16_t updateEntry(uint8_t entryNum, entry_t* entry);
   void removeEntry (uint8_t entryNum); 
   
-  void format( byte* pass, char* name );
+  //Returns the time it took, in ms
+  uint32_t format( byte* pass, char* name );
+
+  //Checks each entry against the check value stored along with it, reading
+  //the EEPROM without decrypting anything. Returns the number of entries that
+  //fail and lists the first maxBad of them in bad. elapsed gets the time it
+  //took, in ms.
+  uint8_t scrub( uint8_t* bad, uint8_t maxBad, uint32_t* elapsed );
   uint8_t getNbEntries();
+  uint8_t getMaxEntries();
+
+  //Titles read and decrypted since last reset, searches included.
+  uint16_t getTitleReads();
+  void resetTitleReads();
+
+  //Jump by first character: the first entry of the next group of titles
+  //starting alike, or of this group or the one before. Titles are read when
+  //there is no sort key index.
+  uint8_t nextInitial( uint8_t entryNum );
+  uint8_t prevInitial( uint8_t entryNum );
 
 private:
-  void putPass( byte* pass );
+  void setLayout( uint8_t distance );
+  void migrateLayout();
+  void loadSlotMap();
+  void finishMapMove();
+  void storeMap( uint8_t from, uint8_t to );
+  void buildChecks();
+  bool getField( uint8_t entryNum, bool password, char* dst, uint8_t size );
+  uint8_t initialOf( uint8_t entryNum );
+  uint8_t findInitial( uint16_t c );
+  uint8_t findPosition( const char* title, uint8_t skip );
+  void moveEntry( uint8_t from, uint8_t to );
+#if ES_SORT_KEY_ENTRIES > 0
+  void buildSortKeys();
+  uint8_t findSortKey( const uint8_t* key, uint8_t after, uint8_t skip );
+  uint8_t sortKeys[ES_SORT_KEY_ENTRIES][ES_SORT_KEY_LEN];
+  uint8_t keysValid;
+#endif
+#if ES_TITLE_CACHE_ENTRIES > 0
+  void clearTitleCache();
+  char titleCache[ES_TITLE_CACHE_ENTRIES][ENTRY_TITLE_SIZE];
+  uint8_t titleCacheEntry[ES_TITLE_CACHE_ENTRIES]; //Entry number, NUM_ENTRIES_MAX when unused
+  uint8_t titleCacheNext;                          //Ring position replaced next
+#endif
+  bool checkPass( byte* k );
+  void passChangeHeader();
+  void passChangeEntries( byte* oldKey, byte* newKey, uint32_t progress );
+  //Header fields (IV, encrypted key, noise) at location, bck is generated
+  //when NULL. pass becomes the key, which is set.
+  void putPass( byte* pass, byte* bck, uint16_t location );
+  void stageEntry( uint8_t slot, entry_t* entry );
+  void finishStagedEntry( uint8_t slot );
   void putIv( byte* dst );
   AES aes;
   uint8_t nbEntries;
-  uint8_t crc8(const uint8_t *addr, uint8_t len);  
+  uint8_t maxEntries;
+  uint16_t titleReads;
+  uint32_t ivNext;
+  uint32_t ivLimit;
+  //Physical slot of each entry in alphabetical order, the free slots after
+  //the first nbEntries. Mirrors the copy in EEPROM.
+  uint8_t slotMap[ES_MAX_ENTRIES];
 };
 
 extern EncryptedStorage ES;
@@ -7,6 +7,21 @@
 #define EEPROM_I2C_ADDR 0x50
 #define EEPROM_TEST_OFFSET 1280
 
+// Uncomment when the EEPROM VCC is fed from an I/O pin: the chip is then
+// switched off after EEPROM_IDLE_POWERDOWN_MS without access, and woken on next access.
+//#define EEPROM_POWER_PIN A2
+#define EEPROM_IDLE_POWERDOWN_MS 2000
+
+// Fastest bus speed tried by I2CprobeClock(), display and EEPROM must both keep up.
+// 400kHz is the rated speed of the SSD1306 and of 24xx parts at this supply. Many
+// modules run at 1MHz too, but a good read-back at boot does not show writes are
+// reliable over temperature: define it to I2C_FASTPLUS_CLOCK to opt in anyway.
+#ifndef I2C_MAX_CLOCK
+#define I2C_MAX_CLOCK I2C_FAST_CLOCK
+#endif
+// Transactions that must succeed at a speed before it is retained
+#define I2C_PROBE_ROUNDS 8
+
 #ifdef BLUEKEY_KNOB
 #define knobInterruptPin 3
 #define knobDataPin 12
@@ -115,6 +130,8 @@
 #define DEVNAME_BUFF_LEN 32 // must be = EEPROM_DEVICENAME_LENGTH since ES.format modifies buffer content
 
 #define PASSWORD_MAX_LENGTH 16
+// Generated ones are not typed in, entry_t holds a full login and this many
+#define PASSWORD_GENERATED_MAX_LENGTH 32
 
 #define ACCOUNT_TITLE_LENGTH 12
 #define ACCOUNT_LOGIN_LENGTH 12
@@ -147,8 +164,10 @@ enum SendPasswordMenuSelection {
 
 enum ManagePasswordsMenuSelection {
   MANAGEPWD_MENU_SETPWD = 0,
+  MANAGEPWD_MENU_EDITPWD,
   MANAGEPWD_MENU_DELPWD,
   MANAGEPWD_MENU_FORMAT,
+  MANAGEPWD_MENU_CHANGEPIN,
   MANAGEPWD_MENU_CHECKNBENTRIES,
   MANAGEPWD_MENU_TEST1,
   MANAGEPWD_MENU_TEST2,
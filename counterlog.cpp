@@ -0,0 +1,171 @@
+#include "counterlog.h"
+#include "eeprom.h"
+
+typedef struct {
+  uint16_t seq;
+  uint8_t id;
+  uint8_t crc;
+  uint32_t value;
+} counter_slot_t;
+
+// Slots read per transaction while scanning
+#define COUNTER_SCAN_SLOTS 8
+
+// Non-zero so that a zero-filled slot (id 0, crc 0) does not check out
+#define COUNTER_CRC_SEED 0xA5
+
+#define slotOffset( slot ) (COUNTER_LOG_START + (COUNTER_SLOT_SIZE*(slot)))
+
+static uint8_t slotCrc(counter_slot_t* s)
+{
+  uint8_t crc = s->crc;
+  
+  s->crc = 0;
+  uint8_t r = crc8((uint8_t*)s, COUNTER_SLOT_SIZE, COUNTER_CRC_SEED);
+  s->crc = crc;
+  return(r);
+}
+
+void __attribute__ ((noinline)) CounterLog::initialize()
+{
+  counter_slot_t slots[COUNTER_SCAN_SLOTS];
+  uint16_t seqs[COUNTER_MAX];
+  bool any = false;
+  
+  known = 0;
+  head = 0;
+  seq = 0;
+
+  for(uint8_t i = 0; i < COUNTER_LOG_SLOTS; i += COUNTER_SCAN_SLOTS)
+  {
+    I2E_Read(slotOffset(i), (byte*)slots, sizeof(slots));
+    
+    for(uint8_t j = 0; j < COUNTER_SCAN_SLOTS; j++)
+    {
+      counter_slot_t* s = &slots[j];
+      
+      // Blank (0xFF or 0x00) or torn slots are skipped
+      if( (s->id >= COUNTER_MAX) || (slotCrc(s) != s->crc) ) continue;
+
+      // Sequence numbers wrap, live ones are never more than a ring apart
+      if( !(known & (1 << s->id)) || ((int16_t)(s->seq - seqs[s->id]) > 0) )
+      {
+        known |= (1 << s->id);
+        seqs[s->id] = s->seq;
+        values[s->id] = s->value;
+        where[s->id] = i + j;
+      }
+      
+      if( !any || ((int16_t)(s->seq - seq) >= 0) )
+      {
+        any = true;
+        seq = s->seq + 1;
+        head = (i + j + 1) % COUNTER_LOG_SLOTS;
+      }
+    }
+  }
+}
+
+void __attribute__ ((noinline)) CounterLog::format()
+{
+  byte blank[COUNTER_SLOT_SIZE * COUNTER_SCAN_SLOTS];
+  
+  memset(blank, 0xFF, sizeof(blank));
+  for(uint8_t i = 0; i < COUNTER_LOG_SLOTS; i += COUNTER_SCAN_SLOTS)
+  {
+    I2E_Write(slotOffset(i), blank, sizeof(blank));
+  }
+
+  known = 0;
+  head = 0;
+  seq = 0;
+}
+
+bool CounterLog::get(uint8_t id, uint32_t* value)
+{
+  if( !(known & (1 << id)) ) return(false);
+  
+  *value = values[id];
+  return(true);
+}
+
+void __attribute__ ((noinline)) CounterLog::set(uint8_t id, uint32_t value)
+{
+  if( (known & (1 << id)) && (values[id] == value) ) return;
+
+  // The slot about to be reused may hold the only record of another counter,
+  // carry it forward first. That moves head on, the next slot is checked too.
+  bool carried;
+  do {
+    carried = false;
+    for(uint8_t i = 0; i < COUNTER_MAX; i++)
+    {
+      if( (i != id) && (known & (1 << i)) && (where[i] == head) )
+      {
+        append(i, values[i]);
+        carried = true;
+      }
+    }
+  } while( carried );
+  
+  append(id, value);
+}
+
+void __attribute__ ((noinline)) CounterLog::clear(uint8_t id)
+{
+  counter_slot_t slots[COUNTER_SCAN_SLOTS];
+  byte blank[COUNTER_SLOT_SIZE];
+
+  // The new record has to be on the chip before any older one goes, else a
+  // reset in between could bring back one older still
+  set(id, 0);
+  eeprom.flush();
+
+  memset(blank, 0xFF, sizeof(blank));
+  for(uint8_t i = 0; i < COUNTER_LOG_SLOTS; i += COUNTER_SCAN_SLOTS)
+  {
+    I2E_Read(slotOffset(i), (byte*)slots, sizeof(slots));
+
+    for(uint8_t j = 0; j < COUNTER_SCAN_SLOTS; j++)
+    {
+      counter_slot_t* s = &slots[j];
+
+      if( (s->id != id) || (slotCrc(s) != s->crc) || (i + j == where[id]) ) continue;
+      I2E_Write(slotOffset(i + j), blank, sizeof(blank));
+    }
+  }
+}
+
+void CounterLog::append(uint8_t id, uint32_t value)
+{
+  counter_slot_t s;
+
+  s.seq = seq++;
+  s.id = id;
+  s.value = value;
+  s.crc = slotCrc(&s);
+  
+  I2E_Write(slotOffset(head), (byte*)&s, COUNTER_SLOT_SIZE);
+  
+  known |= (1 << id);
+  values[id] = value;
+  where[id] = head;
+  head = (head + 1) % COUNTER_LOG_SLOTS;
+}
+
+// Dallas/Maxim crc8
+uint8_t crc8(const uint8_t *addr, uint8_t len, uint8_t crc)
+{
+  while (len--) {
+    uint8_t inbyte = *addr++;
+    for (uint8_t i = 8; i; i--) {
+      uint8_t mix = (crc ^ inbyte) & 0x01;
+      crc >>= 1;
+      if (mix) crc ^= 0x8C;
+      inbyte >>= 1;
+    }
+  }
+  return crc;
+}
+
+CounterLog counters = CounterLog();
@@ -0,0 +1,85 @@
+/*
+  The Final Key is an encrypted hardware password manager, 
+  this is the sourcecode for the firmware. 
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __counterlog_H__
+#define __counterlog_H__
+#include <Arduino.h>
+
+//Wear-leveled storage for small counters that change often. Each update is
+//appended to a ring of sequence-numbered slots in the reserved EEPROM area
+//instead of rewriting the same byte, the latest record of a counter wins.
+//Endurance is counted per write page and each append rewrites one, so the
+//gain is the number of pages the ring spans: 4 on 128-byte page parts, 16 on
+//32-byte ones. The reserved area has no room for a larger ring.
+
+//Log region, within the reserved area between header and entries
+#define COUNTER_LOG_START 256
+#define COUNTER_LOG_SIZE 512
+
+//Slot: sequence number (2), counter id (1), seeded crc8 of the rest (1), value (4)
+#define COUNTER_SLOT_SIZE 8
+#define COUNTER_LOG_SLOTS (COUNTER_LOG_SIZE / COUNTER_SLOT_SIZE)
+
+//Counter ids
+#define COUNTER_NB_ENTRIES 0
+#define COUNTER_ENTRY_DISTANCE 1  //Slot size of the entry layout
+#define COUNTER_MIGRATION 2       //Entries left to move to that layout
+#define COUNTER_SLOT_MAP 3        //Number of slots covered by the slot map
+#define COUNTER_IV 4              //IV counter, reserved up to this value
+#define COUNTER_CHECKS 5          //Set once the entries have check values
+#define COUNTER_PASS_CHANGE 6     //Progress of a PIN change, see changePass()
+#define COUNTER_MAP_MOVE 7        //Slot map move under way, see moveEntry()
+#define COUNTER_STAGED_SLOT 8     //Slot being rewritten from the scratch slot
+#define COUNTER_MAX 9
+
+class CounterLog
+{
+public:
+  //Scans the ring for the latest record of each counter.
+  void initialize();
+
+  //Empties the log, all counters become unknown.
+  void format();
+
+  //False when the counter was never set since format.
+  bool get(uint8_t id, uint32_t* value);
+
+  //Appends a record unless the value is unchanged. Writes go through the
+  //EEPROM cache like any other, eeprom.flush() or poll() completes them.
+  void set(uint8_t id, uint32_t value);
+
+  //Sets the counter to 0 and blanks its older records, for values that must
+  //not linger in the ring. Flushes the new record first, the caller flushes
+  //the rest.
+  void clear(uint8_t id);
+
+private:
+  void append(uint8_t id, uint32_t value);
+  uint32_t values[COUNTER_MAX];
+  uint8_t where[COUNTER_MAX];  //Slot of the latest record
+  uint16_t known;              //Bit per counter with a record
+  uint8_t head;                //Next slot to write
+  uint16_t seq;
+};
+
+extern CounterLog counters;
+
+//Continues from crc, so that a crc can run over several buffers
+uint8_t crc8(const uint8_t *addr, uint8_t len, uint8_t crc = 0);
+
+#endif
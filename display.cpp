@@ -1,3 +1,102 @@
 
 #include "display.h"
-Adafruit_SSD1306 display(OLED_RESET);
+#include "i2c.h"
+
+// First byte of each transaction tells whether commands or display RAM data follow
+#define SSD1306_CONTROL_COMMAND 0x00
+#define SSD1306_CONTROL_DATA 0x40
+
+static uint8_t buffer[SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8];
+
+SSD1306::SSD1306(int8_t reset) : Adafruit_GFX(SSD1306_LCDWIDTH, SSD1306_LCDHEIGHT)
+{
+  rst = reset;
+}
+
+void SSD1306::begin(uint8_t vccstate, uint8_t addr)
+{
+  i2caddr = addr;
+  i2c.begin();
+
+  // Pulse reset line
+  if(rst >= 0)
+  {
+    pinMode(rst, OUTPUT);
+    digitalWrite(rst, HIGH);
+    delay(1);
+    digitalWrite(rst, LOW);
+    delay(10);
+    digitalWrite(rst, HIGH);
+  }
+
+  // Init sequence for 128x32, same as Adafruit_SSD1306
+  ssd1306_command(SSD1306_DISPLAYOFF);
+  ssd1306_command(SSD1306_SETDISPLAYCLOCKDIV);
+  ssd1306_command(0x80);
+  ssd1306_command(SSD1306_SETMULTIPLEX);
+  ssd1306_command(SSD1306_LCDHEIGHT - 1);
+  ssd1306_command(SSD1306_SETDISPLAYOFFSET);
+  ssd1306_command(0x0);
+  ssd1306_command(SSD1306_SETSTARTLINE | 0x0);
+  ssd1306_command(SSD1306_CHARGEPUMP);
+  ssd1306_command((vccstate == SSD1306_EXTERNALVCC)?0x10:0x14);
+  ssd1306_command(SSD1306_MEMORYMODE);
+  ssd1306_command(0x00); // horizontal addressing, matches buffer layout
+  ssd1306_command(SSD1306_SEGREMAP | 0x1);
+  ssd1306_command(SSD1306_COMSCANDEC);
+  ssd1306_command(SSD1306_SETCOMPINS);
+  ssd1306_command(0x02);
+  ssd1306_command(SSD1306_SETCONTRAST);
+  ssd1306_command(0x8F);
+  ssd1306_command(SSD1306_SETPRECHARGE);
+  ssd1306_command((vccstate == SSD1306_EXTERNALVCC)?0x22:0xF1);
+  ssd1306_command(SSD1306_SETVCOMDETECT);
+  ssd1306_command(0x40);
+  ssd1306_command(SSD1306_DISPLAYALLON_RESUME);
+  ssd1306_command(SSD1306_NORMALDISPLAY);
+  ssd1306_command(SSD1306_DEACTIVATE_SCROLL);
+  ssd1306_command(SSD1306_DISPLAYON);
+}
+
+void SSD1306::ssd1306_command(uint8_t c)
+{
+  byte control = SSD1306_CONTROL_COMMAND;
+  i2c.write(i2caddr, &control, 1, &c, 1);
+}
+
+void SSD1306::clearDisplay()
+{
+  memset(buffer, 0, sizeof(buffer));
+}
+
+void SSD1306::display()
+{
+  byte control = SSD1306_CONTROL_COMMAND;
+  byte window[6] = { SSD1306_COLUMNADDR, 0, SSD1306_LCDWIDTH - 1,
+                     SSD1306_PAGEADDR, 0, (SSD1306_LCDHEIGHT / 8) - 1 };
+
+  // Bus speed is whatever I2CprobeClock() settled on, shared with the EEPROM
+  i2c.write(i2caddr, &control, 1, window, sizeof(window));
+
+  // Whole frame in one transaction, streamed straight from the frame buffer
+  control = SSD1306_CONTROL_DATA;
+  i2c.write(i2caddr, &control, 1, buffer, sizeof(buffer));
+}
+
+void SSD1306::drawPixel(int16_t x, int16_t y, uint16_t color)
+{
+  if( (x < 0) || (x >= width()) || (y < 0) || (y >= height()) ) return;
+
+  // One byte covers 8 vertical pixels of a page
+  uint8_t* b = &buffer[x + (y / 8) * SSD1306_LCDWIDTH];
+  uint8_t mask = _BV(y & 7);
+
+  switch(color)
+  {
+    case WHITE:   *b |= mask;  break;
+    case BLACK:   *b &= ~mask; break;
+    case INVERSE: *b ^= mask;  break;
+  }
+}
+
+SSD1306 display(OLED_RESET);
@@ -20,9 +20,60 @@
 #define __display_H__
 
 #include <Adafruit_GFX.h>
-#include <Adafruit_SSD1306.h>
 #include "constants.h"
 
-extern Adafruit_SSD1306 display;
+//Minimal SSD1306 128x32 driver on top of the i2c master, so that Wire (and its
+//buffers) is not linked in. API is the subset of Adafruit_SSD1306 used by the firmware.
+
+#define SSD1306_LCDWIDTH DISPLAY_WIDTH
+#define SSD1306_LCDHEIGHT DISPLAY_HEIGHT
+
+#define BLACK 0
+#define WHITE 1
+#define INVERSE 2
+
+#define SSD1306_EXTERNALVCC 0x1
+#define SSD1306_SWITCHCAPVCC 0x2
+
+#define SSD1306_MEMORYMODE 0x20
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_DEACTIVATE_SCROLL 0x2E
+#define SSD1306_SETSTARTLINE 0x40
+#define SSD1306_SETCONTRAST 0x81
+#define SSD1306_CHARGEPUMP 0x8D
+#define SSD1306_SEGREMAP 0xA0
+#define SSD1306_DISPLAYALLON_RESUME 0xA4
+#define SSD1306_NORMALDISPLAY 0xA6
+#define SSD1306_SETMULTIPLEX 0xA8
+#define SSD1306_DISPLAYOFF 0xAE
+#define SSD1306_NOP 0xE3
+#define SSD1306_DISPLAYON 0xAF
+#define SSD1306_COMSCANINC 0xC0
+#define SSD1306_COMSCANDEC 0xC8
+#define SSD1306_SETDISPLAYOFFSET 0xD3
+#define SSD1306_SETDISPLAYCLOCKDIV 0xD5
+#define SSD1306_SETPRECHARGE 0xD9
+#define SSD1306_SETCOMPINS 0xDA
+#define SSD1306_SETVCOMDETECT 0xDB
+
+class SSD1306 : public Adafruit_GFX
+{
+public:
+  SSD1306(int8_t reset);
+
+  void begin(uint8_t vccstate, uint8_t i2caddr);
+  void ssd1306_command(uint8_t c);
+  void clearDisplay();
+  void display();
+
+  void drawPixel(int16_t x, int16_t y, uint16_t color);
+
+private:
+  int8_t rst;
+  uint8_t i2caddr;
+};
+
+extern SSD1306 display;
 
 #endif
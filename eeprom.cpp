@@ -1,56 +1,647 @@
-#include <Wire.h>
 #include "eeprom.h"
+#include "i2c.h"
 #include "constants.h"
 
-uint16_t EEPROM::dataOp(uint16_t eeaddress, byte* data, uint8_t len, uint8_t write)
+// Read-back granularity of compare-before-write, bounds the stack buffer
+#define EEPROM_COMPARE_CHUNK 32
+
+// Smallest part handled, 24xx32. Below that parts use a single address byte.
+#define EEPROM_MIN_CHIP_BITS 12
+
+// Head of the vault header compared at each alias: identifier, device name,
+// IV and the key cipher, random once formatted
+#define EEPROM_DETECT_SPAN 96
+
+// Up to 8 chips, A0-A2 strapped from EEPROM_I2C_ADDR upwards
+#define EEPROM_MAX_CHIPS 8
+
+#if EEPROM_IO_STATS
+#define IO_STATS(x) { eeprom_io_stats_t* io = &ioStats[activeTag]; x }
+#else
+#define IO_STATS(x)
+#endif
+
+// A 24xx part NACKs its address while an internal write cycle is in progress.
+// Datasheets give 5ms max, bail out well after that in case the chip is absent.
+#define EEPROM_WRITE_CYCLE_TIMEOUT_US 20000
+
+// Power management is only active when the chip supply is on a pin.
+void EEPROM::power(uint8_t state)
 {
-  //printFreeRam("EEPROMdataOP",0);
+#ifdef EEPROM_POWER_PIN
+  if(state == EEPROM_POWER_ON)
+  {
+    if(powered) return;
+
+    unsigned long start = micros();
+    
+    pinMode(EEPROM_POWER_PIN, OUTPUT);
+    digitalWrite(EEPROM_POWER_PIN, HIGH);
+    powered = 1;
+
+    // Chip answers its address once its power-on reset is over
+    while( !i2c.probe(EEPROM_I2C_ADDR) && ((micros() - start) < EEPROM_WRITE_CYCLE_TIMEOUT_US) );
+
+    wakeTime += micros() - start;
+    wakeCount++;
+    lastAccess = millis();
+  } else {
+    if(!powered) return;
+    
+    // Nothing may be left in RAM or in the middle of a write cycle
+    flush();
+    waitReady();
+
+    // SDA/SCL stay pulled up for the display, the chip may draw a little through them
+    digitalWrite(EEPROM_POWER_PIN, LOW);
+    powered = 0;
+    readAddressValid = 0;
+  }
+#else
+  if(state == EEPROM_POWER_OFF)
+  {
+    flush();
+  }
+#endif
+}
+
+// Finds the size of the chip at EEPROM_I2C_ADDR from the address counter
+// wrapping around, then counts the identical chips at the next addresses.
+// The header span is compared with reads alone, a cell is only written (and
+// restored) when that span is blank and cannot tell, i.e. on a new chip.
+uint32_t EEPROM::detect()
+{
+  uint8_t bits;
+
+  flush();
+  chipBits = 16;
+  nbChips = 1;
+  
+  for(bits = EEPROM_MIN_CHIP_BITS; bits < 16; bits++)
+  {
+    uint16_t alias = (uint16_t)1 << bits;
+    byte low[16];
+    byte high[16];
+    bool same = true;
+    bool blank = true;
+
+    for(uint8_t offset = 0; same && (offset < EEPROM_DETECT_SPAN); offset += sizeof(low))
+    {
+      readChip(offset, low, sizeof(low));
+      readChip(alias + offset, high, sizeof(high));
+      same = !memcmp(low, high, sizeof(low));
+      for(uint8_t i = 0; i < sizeof(low); i++)
+      {
+        if( (low[i] != 0x00) && (low[i] != 0xFF) ) blank = false;
+      }
+    }
+    if( !same ) continue;
+    // A formatted header (identifier, name, IV) showing up twice is the wrap
+    if( !blank ) break;
+
+    // Blank, flip a byte at the alias and see if address 0 follows
+    readChip(0, low, 1);
+    readChip(alias, high, 1);
+    byte b = ~high[0];
+    writeChip(alias, &b, 1);
+    readChip(0, &b, 1);
+    writeChip(alias, high, 1);
+    
+    if( b != low[0] ) break;
+  }
+  chipBits = bits;
+
+  // Page write buffer shrinks with the part: 32 bytes up to 64Kbit, 64 up to 256Kbit
+  writePage = (bits <= 13)?32:((bits <= 15)?64:128);
+  if(writePage > EEPROM_PAGE_SIZE) writePage = EEPROM_PAGE_SIZE;
+
+  // Linear addresses are 16-bit, chips past 64KB are not reachable
+  while( (nbChips < EEPROM_MAX_CHIPS) && (((uint32_t)(nbChips + 1) << bits) <= 65536L) &&
+         i2c.probe(EEPROM_I2C_ADDR + nbChips) )
+  {
+    nbChips++;
+  }
+
+  readAddressValid = 0;
+  return(getCapacity());
+}
+
+uint32_t EEPROM::getCapacity()
+{
+  return( (uint32_t)((nbChips)?nbChips:1) << ((chipBits)?chipBits:16) );
+}
+
+uint8_t EEPROM::getWritePage()
+{
+  return( (writePage)?writePage:EEPROM_PAGE_SIZE );
+}
+
+// Bus address of the chip holding eeaddress
+uint8_t EEPROM::chipOf(uint16_t eeaddress)
+{
+  return( EEPROM_I2C_ADDR + (uint8_t)((uint32_t)eeaddress >> ((chipBits)?chipBits:16)) );
+}
+
+// Bytes from eeaddress to the end of its chip
+uint32_t EEPROM::chipLeft(uint16_t eeaddress)
+{
+  uint8_t bits = (chipBits)?chipBits:16;
+  return( ((((uint32_t)eeaddress >> bits) + 1) << bits) - eeaddress );
+}
+
+void EEPROM::setIdleTimeout(uint16_t ms)
+{
+  idleTimeout = ms;
+}
+
+// Called before any chip access
+void EEPROM::wake()
+{
+#ifdef EEPROM_POWER_PIN
+  if(!powered) power(EEPROM_POWER_ON);
+  lastAccess = millis();
+#endif
+}
+
+void EEPROM::waitReady()
+{
+  if(!writePending) return;
+
+  unsigned long start = micros();
   
+  // Keep addressing the chip until it ACKs, meaning the write cycle is over.
+  while( !i2c.probe(writeChipAddr) && ((micros() - start) < EEPROM_WRITE_CYCLE_TIMEOUT_US) )
+  {
+    IO_STATS( io->transactions++; )
+  }
+
+  waitTime += micros() - start;
+  IO_STATS( io->transactions++; io->waitTime += micros() - start; )
+  writePending = 0;
+}
+
+// Reads are not bound to pages: the chip address counter rolls over to the next
+// page on its own, so the whole length is read in one transaction per chip.
+// When the read starts where the previous one ended, the address phase is skipped
+// and the chip current-address read is used instead.
+void EEPROM::readChip(uint16_t eeaddress, byte* data, uint8_t len)
+{
+  if(!len) return;
+
+  wake();
+  waitReady();
+
   while(len)
   {
-    uint8_t lenForPage;
-    //lenForPage = (len > 31)?32:len;
-    lenForPage = (len > 15)?16:len;
+    uint8_t status;
+    uint8_t lenForChip = len;
     
-    uint8_t currentPageOffset = eeaddress%128;
-    uint8_t nextPageOffset = (eeaddress+lenForPage)%128;
+    if( chipLeft(eeaddress) < len )
+    {
+      lenForChip = chipLeft(eeaddress);
+    }
+
+    if( readAddressValid && (readAddress == eeaddress) )
+    {
+      status = i2c.read(chipOf(eeaddress), 0, 0, data, lenForChip);
+    } else {
+      byte addr[2] = { (byte)(eeaddress >> 8), (byte)(eeaddress & 0xFF) };
+      status = i2c.read(chipOf(eeaddress), addr, 2, data, lenForChip);
+    }
+
+    // On error we no longer know where the chip counter stands, and at the end
+    // of a chip the counter wraps to its start rather than to the next chip.
+    readAddressValid = (status == I2C_OK) && (lenForChip != chipLeft(eeaddress));
+    readAddress = eeaddress + lenForChip;
+    IO_STATS( io->transactions++; io->bytesRead += lenForChip; )
+
+    data+=lenForChip;
+    eeaddress+=lenForChip;
+    len -= lenForChip;
+  }
+}
+
+// Narrows [*from, *from + *len) to the bytes that differ from the chip.
+// Returns false when all of them already match.
+bool EEPROM::diffChip(uint16_t eeaddress, byte* data, uint8_t* from, uint8_t* len)
+{
+  byte chip[EEPROM_COMPARE_CHUNK];
+  int16_t first = -1;
+  uint8_t last = 0;
+
+  for(uint8_t i = 0; i < *len; i += EEPROM_COMPARE_CHUNK)
+  {
+    uint8_t n = *len - i;
+    if(n > EEPROM_COMPARE_CHUNK) n = EEPROM_COMPARE_CHUNK;
     
-    if( nextPageOffset < currentPageOffset )
+    readChip(eeaddress + i, chip, n);
+    for(uint8_t j = 0; j < n; j++)
     {
-      lenForPage -= nextPageOffset;
+      if(chip[j] != data[i + j])
+      {
+        if(first < 0) first = i + j;
+        last = i + j;
+      }
     }
+  }
+
+  if(first < 0) return(false);
+
+  *from = first;
+  *len = last - first + 1;
+  return(true);
+}
+
+void EEPROM::writeChip(uint16_t eeaddress, byte* data, uint8_t len)
+{
+  wake();
+
+  while(len)
+  {
+    // Up to the end of current page, chip would wrap around within the page otherwise
+    uint8_t page = (writePage)?writePage:EEPROM_PAGE_SIZE;
+    uint8_t lenForPage = page - (eeaddress % page);
+    uint8_t from = 0;
+    uint8_t lenToWrite;
     
-    //Start communication with eeprom, send address
-    Wire.beginTransmission(EEPROM_I2C_ADDR); //Last one tells to WRITE  
-    Wire.write((uint16_t)(eeaddress >> 8)); // MSB
-    Wire.write((uint16_t)(eeaddress & 0xFF)); // LSB    
+    if( lenForPage > len )
+    {
+      lenForPage = len;
+    }
+    lenToWrite = lenForPage;
+
+    if( compareWrites && !diffChip(eeaddress, data, &from, &lenToWrite) )
+    {
+      // Chip already holds this, save the write cycle
+      writeStats.pagesElided++;
+      writeStats.bytesElided += lenForPage;
+    } else {
+      writeStats.bytesElided += lenForPage - lenToWrite;
+
+      // Previous page may still be programming, chip will not answer until it is done.
+      waitReady();
+      
+      uint16_t target = eeaddress + from;
+      byte addr[2] = { (byte)(target >> 8), (byte)(target & 0xFF) };
+      writeChipAddr = chipOf(target);
+      i2c.write(writeChipAddr, addr, 2, data + from, lenToWrite);
         
-    if(write)
+      // Write cycle starts at the STOP condition, completion is polled before next access.
+      writePending = 1;
+      readAddressValid = 0;
+      writeStats.pageWrites++;
+      IO_STATS( io->transactions++; io->bytesWritten += lenToWrite; io->pageWrites++; )
+    }
+    
+    data+=lenForPage;
+    eeaddress+=lenForPage;
+    len -= lenForPage;
+  }
+}
+
+#if EEPROM_CACHE_PAGES > 0
+
+int8_t EEPROM::cacheLookup(uint16_t page)
+{
+  for(uint8_t i = 0; i < EEPROM_CACHE_PAGES; i++)
+  {
+    if( cache[i].used && (cache[i].page == page) )
+    {
+      cache[i].stamp = ++cacheTick;
+      return(i);
+    }
+  }
+  return(-1);
+}
+
+// Takes a free slot, else evicts the least recently used page, preferring
+// clean pages.
+uint8_t EEPROM::cacheAlloc(uint16_t page, uint8_t load)
+{
+  uint8_t slot = 0;
+  uint8_t bestRank = 0;
+
+  for(uint8_t i = 0; i < EEPROM_CACHE_PAGES; i++)
+  {
+    uint8_t rank;
+
+    if(!cache[i].used)
+    {
+      slot = i;
+      break;
+    }
+    
+    rank = (cache[i].dirtyTo)?1:2;
+    
+    if( (rank > bestRank) ||
+        ((rank == bestRank) && ((uint16_t)(cacheTick - cache[i].stamp) > (uint16_t)(cacheTick - cache[slot].stamp))) )
+    {
+      slot = i;
+      bestRank = rank;
+    }
+  }
+
+  cacheFlushPage(slot);
+
+  cache[slot].used = 1;
+  cache[slot].page = page;
+  cache[slot].stamp = ++cacheTick;
+
+  if(load)
+  {
+    readChip(page * EEPROM_PAGE_SIZE, cache[slot].data, EEPROM_PAGE_SIZE);
+  }
+  
+  return(slot);
+}
+
+void EEPROM::cacheFlushPage(uint8_t slot)
+{
+  eeprom_page_t* p = &cache[slot];
+  uint8_t tag = activeTag;
+
+  if(!p->dirtyTo) return;
+
+  // Only the span that was written, in a single page write
+  activeTag = p->tag;
+  writeChip(p->page * EEPROM_PAGE_SIZE + p->dirtyFrom, p->data + p->dirtyFrom, p->dirtyTo - p->dirtyFrom);
+  activeTag = tag;
+  p->dirtyTo = 0;
+  cacheStats.flushes++;
+}
+
+#endif
+
+// Pages found in the cache are served from RAM. Misses go to the chip without
+// being cached, so that table scans do not evict the pages being modified.
+uint16_t EEPROM::read(uint16_t eeaddress, byte* data, uint8_t len)
+{
+#if EEPROM_CACHE_PAGES > 0
+  uint16_t missAddress = eeaddress;
+  byte* missData = data;
+  uint8_t missLen = 0;
+
+  while(len)
+  {
+    uint8_t offset = eeaddress % EEPROM_PAGE_SIZE;
+    uint8_t lenForPage = EEPROM_PAGE_SIZE - offset;
+
+    if( lenForPage > len )
     {
-      //Write the length for current page
-      for(uint8_t i = 0; i < lenForPage; i++)
+      lenForPage = len;
+    }
+
+    int8_t slot = cacheLookup(eeaddress / EEPROM_PAGE_SIZE);
+    if(slot >= 0)
+    {
+      // Read what was pending from the chip first, then serve this page
+      readChip(missAddress, missData, missLen);
+      missLen = 0;
+
+      memcpy(data, cache[slot].data + offset, lenForPage);
+      cacheStats.hits++;
+    } else {
+      // Contiguous misses are merged into a single chip read
+      if(!missLen)
       {
-        Wire.write(data[i]);
+        missAddress = eeaddress;
+        missData = data;
       }
-      Wire.endTransmission();
-      data+=lenForPage;
+      missLen += lenForPage;
+      cacheStats.misses++;
+    }
+
+    data+=lenForPage;
+    eeaddress+=lenForPage;
+    len -= lenForPage;
+  }
+
+  readChip(missAddress, missData, missLen);
+#else
+  readChip(eeaddress, data, len);
+  eeaddress+=len;
+#endif
+
+  return(eeaddress);
+}
+
+uint16_t EEPROM::dataOp(uint16_t eeaddress, byte* data, uint8_t len, uint8_t write)
+{
+  //printFreeRam("EEPROMdataOP",0);
+
+  if(!write)
+  {
+    return(read(eeaddress, data, len));
+  }
+
+#if EEPROM_CACHE_PAGES > 0
+  while(len)
+  {
+    uint8_t offset = eeaddress % EEPROM_PAGE_SIZE;
+    uint8_t lenForPage = EEPROM_PAGE_SIZE - offset;
+
+    if( lenForPage > len )
+    {
+      lenForPage = len;
+    }
+
+    // Rest of the page has to come from the chip, unless it is all overwritten
+    uint8_t loaded = (lenForPage != EEPROM_PAGE_SIZE);
+    int8_t slot = cacheLookup(eeaddress / EEPROM_PAGE_SIZE);
+    if(slot < 0)
+    {
+      slot = cacheAlloc(eeaddress / EEPROM_PAGE_SIZE, loaded);
+      cacheStats.misses++;
     } else {
-      //Stop and request data back from address.
-      Wire.endTransmission();
-      Wire.requestFrom((uint8_t)(EEPROM_I2C_ADDR),(uint8_t)lenForPage);
-      while( Wire.available() )
+      loaded = 1;
+      cacheStats.hits++;
+    }
+
+    // Page content is what the chip holds (or will once pending work is done),
+    // so only the bytes that change make it dirty.
+    eeprom_page_t* p = &cache[slot];
+    uint8_t from = EEPROM_PAGE_SIZE;
+    uint8_t to = 0;
+    
+    for(uint8_t i = 0; i < lenForPage; i++)
+    {
+      if( !loaded || (p->data[offset + i] != data[i]) )
       {
-        *(data++)=Wire.read();
+        p->data[offset + i] = data[i];
+        if(from == EEPROM_PAGE_SIZE) from = offset + i;
+        to = offset + i + 1;
       }
     }
 
-   // Successive write with no delays may produce errors, depending on the EEPROM used
-   // 5ms works, 8ms is for margin.
-   delay(8); 
-    
+    if(to)
+    {
+      if( !p->dirtyTo || (from < p->dirtyFrom) )
+      {
+        p->dirtyFrom = from;
+      }
+      if( to > p->dirtyTo )
+      {
+        p->dirtyTo = to;
+      }
+      p->tag = ioTag;
+      writeStats.bytesElided += lenForPage - (to - from);
+    } else {
+      if(!p->dirtyTo) writeStats.pagesElided++;
+      writeStats.bytesElided += lenForPage;
+    }
+
+    data+=lenForPage;
     eeaddress+=lenForPage;
     len -= lenForPage;
   }
+#else
+  writeChip(eeaddress, data, len);
+  eeaddress+=len;
+#endif
   
   return(eeaddress);
 }
+
+void EEPROM::flush()
+{
+#if EEPROM_CACHE_PAGES > 0
+  for(uint8_t i = 0; i < EEPROM_CACHE_PAGES; i++)
+  {
+    cacheFlushPage(i);
+  }
+#endif
+}
+
+void EEPROM::release()
+{
+  wake();
+  flush();
+  waitReady();
+  readAddressValid = 0;
+}
+
+bool EEPROM::busy()
+{
+#if EEPROM_CACHE_PAGES > 0
+  for(uint8_t i = 0; i < EEPROM_CACHE_PAGES; i++)
+  {
+    if(cache[i].dirtyTo) return(true);
+  }
+#endif
+  return(false);
+}
+
+void EEPROM::poll()
+{
+#ifdef EEPROM_POWER_PIN
+  // Switch off once idle long enough
+  if( !busy() && !writePending )
+  {
+    uint16_t timeout = (idleTimeout)?idleTimeout:EEPROM_IDLE_POWERDOWN_MS;
+    if( powered && ((millis() - lastAccess) > timeout) )
+    {
+      power(EEPROM_POWER_OFF);
+    }
+    return;
+  }
+#endif
+
+  // Never wait here: if the chip is still programming, come back on next call
+  if(writePending)
+  {
+    IO_STATS( io->transactions++; )
+    if( !i2c.probe(writeChipAddr) ) return;
+    writePending = 0;
+  }
+
+#if EEPROM_CACHE_PAGES > 0
+  for(uint8_t i = 0; i < EEPROM_CACHE_PAGES; i++)
+  {
+    if(cache[i].dirtyTo)
+    {
+      cacheFlushPage(i);
+      return;
+    }
+  }
+#endif
+}
+
+eeprom_cache_stats_t EEPROM::getCacheStats()
+{
+  return cacheStats;
+}
+
+void EEPROM::resetCacheStats()
+{
+  memset(&cacheStats, 0, sizeof(cacheStats));
+}
+
+void EEPROM::setCompareBeforeWrite(uint8_t enable)
+{
+  compareWrites = enable;
+}
+
+eeprom_write_stats_t EEPROM::getWriteStats()
+{
+  return writeStats;
+}
+
+void EEPROM::resetWriteStats()
+{
+  memset(&writeStats, 0, sizeof(writeStats));
+}
+
+uint8_t EEPROM::setTag(uint8_t tag)
+{
+  uint8_t previous = ioTag;
+  
+  ioTag = tag;
+  activeTag = tag;
+  return(previous);
+}
+
+eeprom_io_stats_t EEPROM::getIoStats(uint8_t tag)
+{
+#if EEPROM_IO_STATS
+  return ioStats[tag];
+#else
+  eeprom_io_stats_t none;
+  memset(&none, 0, sizeof(none));
+  return none;
+#endif
+}
+
+void EEPROM::resetIoStats()
+{
+#if EEPROM_IO_STATS
+  memset(ioStats, 0, sizeof(ioStats));
+#endif
+}
+
+uint32_t EEPROM::getWaitTime()
+{
+  return waitTime;
+}
+
+void EEPROM::resetWaitTime()
+{
+  waitTime = 0;
+}
+
+uint16_t EEPROM::getWakeCount()
+{
+  return wakeCount;
+}
+
+uint32_t EEPROM::getWakeTime()
+{
+  return wakeTime;
+}
+
+void EEPROM::resetWakeStats()
+{
+  wakeCount = 0;
+  wakeTime = 0;
+}
+
+EEPROM eeprom = EEPROM();
@@ -20,19 +20,174 @@
 #define __eeprom_H__
 #include <Arduino.h>
 
+//Largest write page size of the parts in use, 128 for 24LC512/AT24C512. Also the
+//cache page size. detect() lowers the actual write page for smaller parts.
+#define EEPROM_PAGE_SIZE 128
+
+//Number of pages kept in RAM by the write-back cache, 0 disables it.
+//Each page costs EEPROM_PAGE_SIZE + 8 bytes of SRAM.
+#ifndef EEPROM_CACHE_PAGES
+#define EEPROM_CACHE_PAGES 2
+#endif
+
+typedef struct {
+  uint32_t hits;    //Page accesses served from RAM
+  uint32_t misses;  //Page accesses that went to the chip
+  uint32_t flushes; //Dirty pages written back
+} eeprom_cache_stats_t;
+
+typedef struct {
+  uint32_t pageWrites;  //Write transactions issued to the chip
+  uint32_t pagesElided; //Page writes skipped, data already there
+  uint32_t bytesElided; //Bytes written by callers that did not need to reach the chip
+} eeprom_write_stats_t;
+
+//Caller tags for I/O accounting, see setTag()
+#define EEPROM_TAG_OTHER 0
+#define EEPROM_TAG_UNLOCK 1
+#define EEPROM_TAG_GETTITLE 2
+#define EEPROM_TAG_INSERT 3
+#define EEPROM_TAG_REMOVE 4
+#define EEPROM_TAG_FORMAT 5
+#define EEPROM_TAG_UPDATE 6
+#define EEPROM_TAG_SCRUB 7
+#define EEPROM_TAG_GETFIELD 8
+#define EEPROM_TAG_PASSCHANGE 9
+#define EEPROM_TAG_COUNT 10
+
+//Per-tag I/O counters, they cost EEPROM_TAG_COUNT * 16 bytes of SRAM.
+//Set to 1 along with DEBUG_ENABLE to get them printed from loop().
+#ifndef EEPROM_IO_STATS
+#define EEPROM_IO_STATS 0
+#endif
+
+typedef struct {
+  uint16_t transactions; //I2C transactions, busy polls included
+  uint32_t bytesRead;
+  uint32_t bytesWritten;
+  uint16_t pageWrites;   //Write cycles started
+  uint32_t waitTime;     //Microseconds waiting for write cycles to complete
+} eeprom_io_stats_t;
+
+#if EEPROM_CACHE_PAGES > 0
+typedef struct {
+  uint8_t used;
+  uint8_t dirtyFrom;  //Dirty span within the page, clean when dirtyTo is 0
+  uint8_t dirtyTo;
+  uint16_t page;
+  uint16_t stamp;     //Last access, for LRU eviction
+  uint8_t tag;        //Caller of the last write, the write-back is accounted to it
+  byte data[EEPROM_PAGE_SIZE];
+} eeprom_page_t;
+#endif
+
+#define EEPROM_POWER_OFF 0
+#define EEPROM_POWER_ON 1
+
 class EEPROM
 {
 public:
+  //Sizes the chip at EEPROM_I2C_ADDR and counts the identical ones following it,
+  //addresses then run linearly across chips. Returns the capacity in bytes, at
+  //most 64KB. Without it a single 64KB chip is assumed.
+  uint32_t detect();
+  uint32_t getCapacity();
+
+  //Bytes the chip takes in one write cycle, pages are aligned to it.
+  uint8_t getWritePage();
+
+  //Pending writes are completed before switching off. Access while off
+  //switches the chip back on, so calling power(EEPROM_POWER_ON) is optional.
   void power(uint8_t state);
+  void setIdleTimeout(uint16_t ms);
   
-  //Requires page-aligned eeaddress, any len valid, returns addresss after last byte read/written.
+  //Any eeaddress and len valid, returns addresss after last byte read/written.
   uint16_t dataOp(uint16_t eeaddress, byte* data, uint8_t len, uint8_t write);
 
+  //Sequential read, any address and len valid, returns address after last byte read.
+  uint16_t read(uint16_t eeaddress, byte* data, uint8_t len);
+
+  //Background work, one page write at most per call: writes back dirty cache
+  //pages. Call it from the UI loops.
+  void poll();
+  bool busy();
+
+  //Dirty cache pages go to the chip now, in cache slot order rather than the
+  //order they were written in. Call it between writes that depend on each other.
+  void flush();
+
+  //Flushes, then waits for the chip to be powered and idle so that others may
+  //address it directly on the bus. Its address is sent again on next read.
+  void release();
+
+  eeprom_cache_stats_t getCacheStats();
+  void resetCacheStats();
+
+  //Writes through the cache only mark the bytes that change. With compare
+  //enabled, chip writes (write-backs, uncached writes) also read the target back
+  //first and only write the differing span, or nothing. Off by default: at
+  //100kHz reading back a page takes longer than the write cycle it may save.
+  void setCompareBeforeWrite(uint8_t enable);
+  eeprom_write_stats_t getWriteStats();
+  void resetWriteStats();
+
+  //I/O from now on is accounted to tag, returns the previous tag so that callers
+  //can restore it. Nested callers take over, deferred work (cache write-backs)
+  //is accounted to the tag that was current when the data was written.
+  uint8_t setTag(uint8_t tag);
+  eeprom_io_stats_t getIoStats(uint8_t tag);
+  void resetIoStats();
+
+  //Microseconds spent waiting for write cycles to complete, since last reset.
+  uint32_t getWaitTime();
+  void resetWaitTime();
+
+  //Number of power-ups and microseconds spent waiting for the chip to answer after them.
+  uint16_t getWakeCount();
+  uint32_t getWakeTime();
+  void resetWakeStats();
+
+private:
+  uint8_t chipOf(uint16_t eeaddress);
+  uint32_t chipLeft(uint16_t eeaddress);
+  void wake();
+  void waitReady();
+  void readChip(uint16_t eeaddress, byte* data, uint8_t len);
+  void writeChip(uint16_t eeaddress, byte* data, uint8_t len);
+  bool diffChip(uint16_t eeaddress, byte* data, uint8_t* from, uint8_t* len);
+#if EEPROM_CACHE_PAGES > 0
+  int8_t cacheLookup(uint16_t page);
+  uint8_t cacheAlloc(uint16_t page, uint8_t load);
+  void cacheFlushPage(uint8_t slot);
+  eeprom_page_t cache[EEPROM_CACHE_PAGES];
+  uint16_t cacheTick;
+#endif
+  eeprom_cache_stats_t cacheStats;
+  eeprom_write_stats_t writeStats;
+  uint8_t compareWrites;
+  uint8_t ioTag;      //Set by the caller
+  uint8_t activeTag;  //Accounted to, differs from ioTag during deferred work
+#if EEPROM_IO_STATS
+  eeprom_io_stats_t ioStats[EEPROM_TAG_COUNT];
+#endif
+  uint8_t chipBits;    //Address bits of one chip, 0 until detect() (64KB)
+  uint8_t nbChips;
+  uint8_t writePage;
+  uint8_t writeChipAddr; //Chip of the last write, polled for completion
+  uint8_t writePending;
+  uint8_t readAddressValid;
+  uint16_t readAddress;
+  uint32_t waitTime;
+  uint8_t powered;
+  uint16_t idleTimeout;
+  unsigned long lastAccess;
+  uint16_t wakeCount;
+  uint32_t wakeTime;
 };
 
 extern EEPROM eeprom;
 
 #define I2E_Write(addr, data, len) eeprom.dataOp(addr, data, len, 1)
-#define I2E_Read(addr, data, len) eeprom.dataOp(addr, data, len, 0)
+#define I2E_Read(addr, data, len) eeprom.read(addr, data, len)
 
 #endif
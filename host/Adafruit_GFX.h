@@ -0,0 +1,13 @@
+#ifndef __host_Adafruit_GFX_H__
+#define __host_Adafruit_GFX_H__
+#include <Arduino.h>
+
+//Enough for display.h to be included, the display itself is not built on the host
+class Adafruit_GFX : public Print
+{
+public:
+  Adafruit_GFX(int16_t w, int16_t h) {}
+  virtual void drawPixel(int16_t x, int16_t y, uint16_t color) = 0;
+};
+
+#endif
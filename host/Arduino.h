@@ -0,0 +1,95 @@
+/*
+  The Final Key is an encrypted hardware password manager, 
+  this is the sourcecode for the firmware. 
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __host_Arduino_H__
+#define __host_Arduino_H__
+
+//Subset of the Arduino core used by the storage code, for host builds.
+//Time is simulated: it only moves when the I2C model or delay() says so.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define SDA 18
+#define SCL 19
+
+#define DEC 10
+#define HEX 16
+
+#define F_CPU 16000000UL
+#define F(x) (x)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+
+class Print
+{
+public:
+  size_t write(uint8_t c) { return fputc(c, stdout) != EOF; }
+  size_t print(const char* s) { return fputs(s, stdout) >= 0 ? strlen(s) : 0; }
+  size_t print(char c) { return write(c); }
+  size_t print(long n, int base = DEC) { return printf((base == HEX)?"%lX":"%ld", n); }
+  size_t print(unsigned long n, int base = DEC) { return printf((base == HEX)?"%lX":"%lu", n); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  template<class T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template<class T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+  size_t println() { return write('\n'); }
+};
+
+class HardwareSerial : public Print
+{
+public:
+  void begin(long) {}
+  void flush() { fflush(stdout); }
+  int available() { return 0; }
+  int read() { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,3 @@
+#ifndef __host_TermTool_H__
+#define __host_TermTool_H__
+#endif
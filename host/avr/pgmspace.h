@@ -0,0 +1,11 @@
+#ifndef __host_pgmspace_H__
+#define __host_pgmspace_H__
+#include <stdint.h>
+
+//Flash and RAM are the same thing on the host
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+
+#endif
@@ -0,0 +1,373 @@
+/*
+  The Final Key is an encrypted hardware password manager, 
+  this is the sourcecode for the firmware. 
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Runs EncryptedStorage on an EEPROM image file and reports simulated time
+// per operation. See eeprom_image.h for the timing model.
+
+#include <unistd.h>
+#include "EncryptedStorage.h"
+#include "eeprom.h"
+#include "i2c.h"
+#include "constants.h"
+#include "eeprom_image.h"
+
+typedef struct {
+  const char* name;
+  uint8_t tag;
+  uint32_t count;
+  uint64_t foreground;  //Inside the call, the UI is blocked for that long
+  uint64_t deferred;    //Left to eeprom.poll(), runs between key presses
+} op_t;
+
+enum { OP_FORMAT, OP_UNLOCK, OP_INSERT, OP_LIST, OP_SCROLL, OP_UPDATE, OP_REMOVE, OP_SCRUB, OP_PINCHANGE, OP_COUNT };
+
+static op_t ops[OP_COUNT] = {
+  { "format", EEPROM_TAG_FORMAT },
+  { "unlock", EEPROM_TAG_UNLOCK },
+  { "insert", EEPROM_TAG_INSERT },
+  { "list titles", EEPROM_TAG_GETTITLE },
+  { "scroll line", EEPROM_TAG_GETTITLE },
+  { "update", EEPROM_TAG_UPDATE },
+  { "remove", EEPROM_TAG_REMOVE },
+  { "scrub", EEPROM_TAG_SCRUB },
+  { "pin change", EEPROM_TAG_PASSCHANGE },
+};
+
+static uint64_t opStart;
+
+static void begin()
+{
+  opStart = simNanos();
+}
+
+static void drain()
+{
+  while( eeprom.busy() )
+  {
+    eeprom.poll();
+  }
+}
+
+// Foreground time is up to now, then pending work is drained the way the UI
+// loops do it, one poll() at a time, up to the end of the last write cycle.
+static void end(uint8_t op)
+{
+  uint64_t t = simNanos();
+  
+  ops[op].count++;
+  ops[op].foreground += t - opStart;
+
+  drain();
+  eeprom.release();
+  ops[op].deferred += simNanos() - t;
+}
+
+static void makeKey(byte* key, const char* pin)
+{
+  memset(key, 0, USERCODE_BUFF_LEN);
+  strncpy((char*)key, pin, USERCODE_BUFF_LEN);
+}
+
+static void makeEntry(entry_t* entry)
+{
+  memset(entry, 0, sizeof(entry_t));
+  for(uint8_t c = 0; c < 10; c++) entry->title[c] = 'a' + random(26);
+  strcpy(entry->data, "login");
+  entry->passwordOffset = strlen(entry->data) + 1;
+  strcpy(entry->data + entry->passwordOffset, "password");
+}
+
+// Titles fetched per insert with 16, 32 and 64 entries stored. The linear
+// column is what the scan from the first entry up to the insertion point took.
+// Each probe is removed again so that the count stays put. Formats the image.
+#define TITLE_PROBES 64
+
+static void titleBenchmark(const char* pin)
+{
+  static const uint8_t sizes[] = { 16, 32, 64 };
+  byte key[USERCODE_BUFF_LEN];
+  char name[DEVNAME_BUFF_LEN];
+  entry_t entry;
+
+  printf("%-8s %7s %13s %13s %12s\n", "entries", "probes", "avg fetches", "max fetches", "linear avg");
+  
+  for(uint8_t s = 0; s < sizeof(sizes); s++)
+  {
+    uint8_t n = sizes[s];
+    uint32_t total = 0, linear = 0;
+    uint16_t most = 0;
+    
+    if(n >= ES.getMaxEntries()) break;
+    
+    memset(name, 0, sizeof(name));
+    strcpy(name, "host");
+    makeKey(key, pin);
+    ES.format(key, name);
+    makeKey(key, pin);
+    ES.unlock(key);
+    
+    for(uint8_t i = 0; i < n; i++)
+    {
+      makeEntry(&entry);
+      ES.insertEntry(&entry);
+      drain();
+    }
+
+    for(uint8_t p = 0; p < TITLE_PROBES; p++)
+    {
+      makeEntry(&entry);
+      ES.resetTitleReads();
+      int16_t index = ES.insertEntry(&entry);
+      uint16_t fetches = ES.getTitleReads();
+      
+      total += fetches;
+      most = (fetches > most)?fetches:most;
+      linear += (index < n)?(index + 1):n;
+      
+      ES.removeEntry(index);
+      drain();
+    }
+
+    printf("%-8u %7u %13.2f %13u %12.2f\n", n, TITLE_PROBES,
+           (double)total / TITLE_PROBES, most, (double)linear / TITLE_PROBES);
+  }
+  eeprom.flush();
+  ES.lock();
+}
+
+#define LIST_LINES 4
+
+static void printTitle( uint8_t entryNum, const char* title, void* ctx )
+{
+  if( *(bool*)ctx )
+  {
+    printf("%3u %s\n", entryNum, title);
+  }
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr, "usage: %s [-k chipKB] [-n chips] [-c clockHz] [-w writeCycleUs]\n"
+                  "          [-p pin] [-i inserts] [-u updates] [-r removes] [-s seed] [-P newpin]\n"
+                  "          [-f] [-l] [-t] image\n"
+                  "Image is created blank when missing, -f formats it, -l prints the titles.\n"
+                  "Every other update gets a new title, the others a new password.\n"
+                  "-t reports title fetches per insert at 16/32/64 entries, it formats the image.\n"
+                  "-P changes the pin last, a change cut short is resumed after unlock.\n", name);
+}
+
+int main(int argc, char** argv)
+{
+  eeprom_image_config_t config = { 65536, 1, 5000 };
+  uint32_t clock = I2C_DEFAULT_CLOCK;
+  const char* pin = "0000";
+  const char* newPin = NULL;
+  int inserts = 32;
+  int updates = 0;
+  int removes = 8;
+  bool forceFormat = false;
+  bool listTitles = false;
+  bool benchTitles = false;
+  byte key[USERCODE_BUFF_LEN];
+  char name[DEVNAME_BUFF_LEN];
+  int opt;
+
+  while( (opt = getopt(argc, argv, "k:n:c:w:p:i:u:r:s:P:flt")) != -1 )
+  {
+    switch(opt)
+    {
+      case 'k': config.chipSize = atoi(optarg) * 1024; break;
+      case 'n': config.nbChips = atoi(optarg); break;
+      case 'c': clock = atol(optarg); break;
+      case 'w': config.writeCycleUs = atoi(optarg); break;
+      case 'p': pin = optarg; break;
+      case 'P': newPin = optarg; break;
+      case 'i': inserts = atoi(optarg); break;
+      case 'u': updates = atoi(optarg); break;
+      case 'r': removes = atoi(optarg); break;
+      case 's': randomSeed(atoi(optarg)); break;
+      case 'f': forceFormat = true; break;
+      case 'l': listTitles = true; break;
+      case 't': benchTitles = true; break;
+      default: usage(argv[0]); return(1);
+    }
+  }
+  if(optind != argc - 1)
+  {
+    usage(argv[0]);
+    return(1);
+  }
+
+  if( !eepromImageOpen(argv[optind], &config) )
+  {
+    fprintf(stderr, "cannot map %s as %u x %u bytes\n", argv[optind], config.nbChips, config.chipSize);
+    return(1);
+  }
+
+  i2c.begin();
+  i2c.setClock(clock);
+  eeprom.resetIoStats();
+  
+  ES.initialize();
+  printf("capacity %u bytes, %u entries max, bus %u Hz\n",
+         (unsigned)eeprom.getCapacity(), ES.getMaxEntries(), (unsigned)clock);
+
+  if(benchTitles)
+  {
+    titleBenchmark(pin);
+    eepromImageClose();
+    return(0);
+  }
+
+  memset(name, 0, sizeof(name));
+  if( forceFormat || !ES.readHeader(name) )
+  {
+    strcpy(name, "host");
+    makeKey(key, pin);
+    begin();
+    ES.format(key, name);
+    end(OP_FORMAT);
+    ES.initialize();
+  }
+
+  makeKey(key, pin);
+  begin();
+  bool unlocked = ES.unlock(key);
+  end(OP_UNLOCK);
+  if(!unlocked)
+  {
+    fprintf(stderr, "wrong pin for this image\n");
+    eepromImageClose();
+    return(1);
+  }
+
+  uint32_t elapsed;
+  if( ES.passChangePending() )
+  {
+    begin();
+    bool resumed = ES.resumePassChange(key, &elapsed);
+    end(OP_PINCHANGE);
+    printf("pin change %s\n", resumed?"resumed":"could not be resumed");
+  }
+
+  for(int i = 0; i < inserts; i++)
+  {
+    entry_t entry;
+    
+    makeEntry(&entry);
+
+    begin();
+    int16_t res = ES.insertEntry(&entry);
+    end(OP_INSERT);
+    if(res < 0) break;
+  }
+
+  //A screen of titles at a time, as pickEntry() does
+  begin();
+  for(uint16_t i = 0; i < ES.getNbEntries(); i += LIST_LINES)
+  {
+    uint32_t elapsed;
+    ES.forEachTitle(i, LIST_LINES, printTitle, &listTitles, &elapsed);
+  }
+  end(OP_LIST);
+
+  //Down the list a line at a time and back up
+  uint16_t last = (ES.getNbEntries() > LIST_LINES)?(ES.getNbEntries() - LIST_LINES):0;
+  for(uint16_t step = 0; step <= 2 * last; step++)
+  {
+    bool quiet = false;
+    uint32_t elapsed;
+    begin();
+    ES.forEachTitle((step <= last)?step:(2 * last - step), LIST_LINES, printTitle, &quiet, &elapsed);
+    end(OP_SCROLL);
+  }
+
+  for(int i = 0; (i < updates) && ES.getNbEntries(); i++)
+  {
+    entry_t entry;
+    uint8_t entryNum = random(ES.getNbEntries());
+    
+    makeEntry(&entry);
+    if(i & 1)
+    {
+      ES.getTitle(entryNum, entry.title);
+    }
+
+    begin();
+    ES.updateEntry(entryNum, &entry);
+    end(OP_UPDATE);
+  }
+
+  for(int i = 0; (i < removes) && ES.getNbEntries(); i++)
+  {
+    begin();
+    ES.removeEntry(random(ES.getNbEntries()));
+    end(OP_REMOVE);
+  }
+
+  uint8_t bad[8];
+  begin();
+  uint8_t nbBad = ES.scrub(bad, sizeof(bad), &elapsed);
+  end(OP_SCRUB);
+
+  if( newPin )
+  {
+    byte newKey[USERCODE_BUFF_LEN];
+    makeKey(key, pin);
+    makeKey(newKey, newPin);
+    begin();
+    bool changed = ES.changePass(key, newKey, &elapsed);
+    end(OP_PINCHANGE);
+    if( changed )
+    {
+      printf("pin changed, %u entries in %u ms, %.1f entries/s\n", ES.getNbEntries(), elapsed,
+             elapsed?(ES.getNbEntries() * 1000.0 / elapsed):0.0);
+    } else {
+      printf("wrong pin, not changed\n");
+    }
+  }
+
+  eeprom.flush();
+  ES.lock();
+
+  printf("%u entries stored, %u failing their check", ES.getNbEntries(), nbBad);
+  for(uint8_t i = 0; (i < nbBad) && (i < sizeof(bad)); i++)
+  {
+    printf("%s%u", i?" ":": ", bad[i]);
+  }
+  printf("\n\n");
+  printf("%-12s %6s %14s %14s %8s %9s %9s %7s %10s\n",
+         "operation", "count", "avg fg (ms)", "avg bg (ms)", "xfers", "read B", "write B", "cycles", "wait (ms)");
+  
+  for(uint8_t i = 0; i < OP_COUNT; i++)
+  {
+    if(!ops[i].count) continue;
+    
+    eeprom_io_stats_t io = eeprom.getIoStats(ops[i].tag);
+    printf("%-12s %6u %14.3f %14.3f %8u %9u %9u %7u %10.3f\n", ops[i].name, ops[i].count,
+           ops[i].foreground / 1e6 / ops[i].count, ops[i].deferred / 1e6 / ops[i].count,
+           io.transactions, io.bytesRead, io.bytesWritten, io.pageWrites, io.waitTime / 1e3);
+  }
+
+  eeprom_image_stats_t img = eepromImageGetStats();
+  printf("\nbus: %u transactions, %u busy NACKs, %u write cycles, %.3f ms simulated\n",
+         img.transactions, img.nacks, img.writeCycles, simNanos() / 1e6);
+
+  eepromImageClose();
+  return(0);
+}
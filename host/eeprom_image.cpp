@@ -0,0 +1,235 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "eeprom_image.h"
+#include "i2c.h"
+#include "constants.h"
+
+// Bus overhead of a transaction besides its bytes, START and STOP
+#define BUS_OVERHEAD_CLOCKS 2
+
+typedef struct {
+  uint16_t counter;        //Internal address counter
+  uint64_t busyUntil;      //End of the running write cycle
+} chip_t;
+
+static byte* image;
+static uint32_t imageSize;
+static eeprom_image_config_t cfg;
+static chip_t chips[8];
+static eeprom_image_stats_t stats;
+static uint64_t now;
+static int32_t powerLeft = -1;  //Page writes until the power cut
+
+uint64_t simNanos()
+{
+  return(now);
+}
+
+void simAdvance(uint64_t ns)
+{
+  now += ns;
+}
+
+bool eepromImageOpen(const char* path, eeprom_image_config_t* config)
+{
+  struct stat st;
+  int fd;
+  bool blank;
+
+  cfg = *config;
+  imageSize = cfg.chipSize * cfg.nbChips;
+
+  fd = open(path, O_RDWR | O_CREAT, 0600);
+  if(fd < 0) return(false);
+
+  if( (fstat(fd, &st) < 0) || ((st.st_size != 0) && ((uint32_t)st.st_size != imageSize)) )
+  {
+    close(fd);
+    return(false);
+  }
+  
+  blank = (st.st_size == 0);
+  if( blank && (ftruncate(fd, imageSize) < 0) )
+  {
+    close(fd);
+    return(false);
+  }
+
+  image = (byte*)mmap(0, imageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(image == MAP_FAILED)
+  {
+    image = 0;
+    return(false);
+  }
+
+  // Erased cells read back as 0xFF
+  if(blank) memset(image, 0xFF, imageSize);
+
+  memset(chips, 0, sizeof(chips));
+  return(true);
+}
+
+void eepromImageClose()
+{
+  if(!image) return;
+  
+  msync(image, imageSize, MS_SYNC);
+  munmap(image, imageSize);
+  image = 0;
+}
+
+eeprom_image_stats_t eepromImageGetStats()
+{
+  return(stats);
+}
+
+void eepromImageResetStats()
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+void eepromImageCutPower(int32_t writes)
+{
+  powerLeft = writes;
+}
+
+uint32_t eepromImageSize()
+{
+  return(imageSize);
+}
+
+void eepromImageSave(byte* dst)
+{
+  memcpy(dst, image, imageSize);
+}
+
+void eepromImageLoad(const byte* src)
+{
+  memcpy(image, src, imageSize);
+  memset(chips, 0, sizeof(chips));
+}
+
+// Page write buffer of the part, same steps as the 24xx family
+static uint16_t pageSize()
+{
+  return( (cfg.chipSize <= 8192)?32:((cfg.chipSize <= 32768)?64:128) );
+}
+
+static void busTime(uint32_t bytes, uint32_t clock)
+{
+  now += ((uint64_t)(bytes * 9 + BUS_OVERHEAD_CLOCKS) * 1000000000ULL) / clock;
+}
+
+// Chip at address, null when nothing answers there or it is programming
+static chip_t* select(uint8_t address, uint32_t clock)
+{
+  int8_t c = address - EEPROM_I2C_ADDR;
+
+  if( !image || (c < 0) || (c >= cfg.nbChips) ) return(0);
+
+  if(now < chips[c].busyUntil)
+  {
+    stats.nacks++;
+    return(0);
+  }
+  return(&chips[c]);
+}
+
+void I2C::begin()
+{
+  setClock(I2C_DEFAULT_CLOCK);
+}
+
+void I2C::setClock(uint32_t frequency)
+{
+  clock = frequency;
+}
+
+uint32_t I2C::getClock()
+{
+  return(clock);
+}
+
+uint8_t I2C::write(uint8_t address, const byte* hdr, uint8_t hdrLen, const byte* data, uint16_t dataLen)
+{
+  stats.transactions++;
+
+  // The display swallows everything
+  if(address == DISPLAY_I2C_ADDR)
+  {
+    busTime(1 + hdrLen + dataLen, clock);
+    return(I2C_OK);
+  }
+
+  chip_t* chip = select(address, clock);
+  if(!chip)
+  {
+    busTime(1, clock);
+    return(I2C_ADDR_NACK);
+  }
+
+  busTime(1 + hdrLen + dataLen, clock);
+  if(hdrLen < 2) return(I2C_OK);
+
+  chip->counter = ((hdr[0] << 8) | hdr[1]) & (cfg.chipSize - 1);
+  if(!dataLen) return(I2C_OK);
+
+  // Past the power cut nothing is written, the firmware just doesn't know yet
+  if(powerLeft == 0) return(I2C_OK);
+  if(powerLeft > 0) powerLeft--;
+
+  // Data wraps around within the page, as on the real part
+  byte* base = image + (chip - chips) * cfg.chipSize;
+  uint16_t page = chip->counter - (chip->counter % pageSize());
+  
+  for(uint16_t i = 0; i < dataLen; i++)
+  {
+    base[page + ((chip->counter - page + i) % pageSize())] = data[i];
+  }
+  
+  chip->busyUntil = now + (uint64_t)cfg.writeCycleUs * 1000;
+  stats.bytesWritten += dataLen;
+  stats.writeCycles++;
+  return(I2C_OK);
+}
+
+uint8_t I2C::read(uint8_t address, const byte* hdr, uint8_t hdrLen, byte* data, uint8_t len)
+{
+  stats.transactions++;
+
+  chip_t* chip = select(address, clock);
+  if(!chip)
+  {
+    busTime(1, clock);
+    return(I2C_ADDR_NACK);
+  }
+
+  if(hdrLen >= 2)
+  {
+    chip->counter = ((hdr[0] << 8) | hdr[1]) & (cfg.chipSize - 1);
+    
+    // Address phase, then repeated START
+    busTime(1 + hdrLen, clock);
+  }
+  busTime(1 + len, clock);
+
+  byte* base = image + (chip - chips) * cfg.chipSize;
+  for(uint8_t i = 0; i < len; i++)
+  {
+    data[i] = base[chip->counter];
+    chip->counter = (chip->counter + 1) & (cfg.chipSize - 1);
+  }
+  
+  stats.bytesRead += len;
+  return(I2C_OK);
+}
+
+bool I2C::probe(uint8_t address)
+{
+  return( write(address, 0, 0, 0, 0) == I2C_OK );
+}
+
+I2C i2c = I2C();
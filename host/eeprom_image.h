@@ -0,0 +1,66 @@
+/*
+  The Final Key is an encrypted hardware password manager, 
+  this is the sourcecode for the firmware. 
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __eeprom_image_H__
+#define __eeprom_image_H__
+#include <Arduino.h>
+
+//Host stand-in for the I2C bus: 24xx chips backed by a memory-mapped image
+//file, with a timing model. The firmware EEPROM class runs on top of it
+//unchanged, cache and ack polling included.
+//
+//Every transaction advances the simulated clock by its length on the wire
+//(9 clocks per byte plus START/STOP) at the current bus clock. A page write
+//keeps the chip NACKing its address for the write cycle time.
+
+typedef struct {
+  uint32_t chipSize;       //Bytes per chip, 4096 to 65536
+  uint8_t nbChips;         //At consecutive addresses from EEPROM_I2C_ADDR
+  uint32_t writeCycleUs;   //tWR, 5000 on the datasheets
+} eeprom_image_config_t;
+
+typedef struct {
+  uint32_t transactions;
+  uint32_t nacks;          //Address NACKed while a write cycle was running
+  uint32_t bytesRead;
+  uint32_t bytesWritten;
+  uint32_t writeCycles;
+} eeprom_image_stats_t;
+
+//Maps the image, creating it blank (0xFF) when missing. An existing image,
+//e.g. dumped from a device, must be chipSize * nbChips bytes long.
+bool eepromImageOpen(const char* path, eeprom_image_config_t* config);
+void eepromImageClose();
+
+eeprom_image_stats_t eepromImageGetStats();
+void eepromImageResetStats();
+
+//Power goes after that many more page writes, the ones following are lost.
+//Negative restores it.
+void eepromImageCutPower(int32_t writes);
+
+//Contents of the image, to put it back between runs
+uint32_t eepromImageSize();
+void eepromImageSave(byte* dst);
+void eepromImageLoad(const byte* src);
+
+//Simulated time since start, in nanoseconds
+uint64_t simNanos();
+void simAdvance(uint64_t ns);
+
+#endif
@@ -0,0 +1,84 @@
+#include <Arduino.h>
+#include "Entropy.h"
+#include "utils.h"
+#include "eeprom_image.h"
+#include "i2c.h"
+#include "constants.h"
+
+// Arduino core on simulated time, see eeprom_image.h
+
+HardwareSerial Serial;
+
+unsigned long millis()
+{
+  return( (unsigned long)(simNanos() / 1000000ULL) );
+}
+
+unsigned long micros()
+{
+  return( (unsigned long)(simNanos() / 1000ULL) );
+}
+
+void delay(unsigned long ms)
+{
+  simAdvance((uint64_t)ms * 1000000ULL);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  simAdvance((uint64_t)us * 1000ULL);
+}
+
+// Runs are reproducible for a given seed, which is what benchmarks want
+long random(long max)
+{
+  return( (max > 0)?(rand() % max):0 );
+}
+
+long random(long min, long max)
+{
+  return( (max > min)?(min + rand() % (max - min)):min );
+}
+
+void randomSeed(unsigned long seed)
+{
+  srand(seed);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+int digitalRead(uint8_t pin) { return(HIGH); }
+void analogWrite(uint8_t pin, int val) {}
+
+// No watchdog jitter to harvest, IVs come from the same PRNG
+void EntropyClass::initialize(void) {}
+
+uint32_t EntropyClass::random(void)
+{
+  return( ((uint32_t)rand() << 16) ^ (uint32_t)rand() );
+}
+
+uint32_t EntropyClass::random(uint32_t max)
+{
+  return( (max)?(random() % max):0 );
+}
+
+uint32_t EntropyClass::random(uint32_t min, uint32_t max)
+{
+  return( (max > min)?(min + random(max - min)):min );
+}
+
+EntropyClass Entropy;
+
+// Nothing is drawn, but the frame push is on the bus like on the device:
+// window commands, then the whole frame, see SSD1306::display()
+void displayCenteredMessage(char* msg)
+{
+  static byte frame[DISPLAY_WIDTH * DISPLAY_HEIGHT / 8];
+  byte window[6] = { 0 };
+  byte control = 0;
+
+  i2c.write(DISPLAY_I2C_ADDR, &control, 1, window, sizeof(window));
+  control = 0x40;
+  i2c.write(DISPLAY_I2C_ADDR, &control, 1, frame, sizeof(frame));
+}
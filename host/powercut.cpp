@@ -0,0 +1,282 @@
+/*
+  The Final Key is an encrypted hardware password manager,
+  this is the sourcecode for the firmware.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Cuts the power at every page write of an insert, update and remove, then
+// boots again and checks the vault: every entry there either as before or
+// as after the operation, none lost, none empty, all in order. Exits 1 on
+// the first failure.
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "EncryptedStorage.h"
+#include "counterlog.h"
+#include "eeprom.h"
+#include "i2c.h"
+#include "constants.h"
+#include "eeprom_image.h"
+
+enum { OP_INSERT, OP_UPDATE, OP_REMOVE };
+
+typedef struct {
+  uint8_t op;
+  int16_t entryNum;     //Last when negative, update and remove
+  const char* title;    //Insert and update, NULL keeps the title
+} run_t;
+
+// First, last, and a page boundary of the slot map in between, so that moves
+// span several write pages
+static const run_t runs[] = {
+  { OP_INSERT, 0, "a" },
+  { OP_INSERT, 0, "zzzzzzzzzzz" },
+  { OP_INSERT, 0, "mmmmmmmmmm" },
+  { OP_UPDATE, 0, "zzzzzzzzzzz" },
+  { OP_UPDATE, -1, "a" },
+  { OP_UPDATE, 20, NULL },
+  { OP_REMOVE, 0, NULL },
+  { OP_REMOVE, -1, NULL },
+  { OP_REMOVE, 31, NULL },
+};
+
+static const char* opNames[] = { "insert", "update", "remove" };
+
+static byte key[USERCODE_BUFF_LEN];
+
+static void makeKey(const char* pin)
+{
+  memset(key, 0, USERCODE_BUFF_LEN);
+  strncpy((char*)key, pin, USERCODE_BUFF_LEN);
+}
+
+static void makeEntry(entry_t* entry, const char* title)
+{
+  memset(entry, 0, sizeof(entry_t));
+  if(title)
+  {
+    strncpy(entry->title, title, ENTRY_TITLE_SIZE - 1);
+  } else {
+    for(uint8_t c = 0; c < 10; c++) entry->title[c] = 'a' + random(26);
+  }
+  strcpy(entry->data, "login");
+  entry->passwordOffset = strlen(entry->data) + 1;
+  strcpy(entry->data + entry->passwordOffset, "password");
+}
+
+// Boot time to let a write cycle under way finish before detect() reads
+#define BOOT_NANOS 10000000ULL
+
+// Whatever was in RAM goes, as on a reset
+static bool boot()
+{
+  simAdvance(BOOT_NANOS);
+  eeprom = EEPROM();
+  counters = CounterLog();
+  ES = EncryptedStorage();
+  ES.initialize();
+  makeKey("0000");
+  return( ES.unlock(key) );
+}
+
+static std::vector<std::string> titles()
+{
+  std::vector<std::string> list;
+  char title[ENTRY_TITLE_SIZE];
+
+  for(uint8_t i = 0; i < ES.getNbEntries(); i++)
+  {
+    if( !ES.getTitle(i, title) )
+    {
+      title[0] = 0;
+    }
+    list.push_back(title);
+  }
+  return(list);
+}
+
+static void run(const run_t* r)
+{
+  entry_t entry;
+  char title[ENTRY_TITLE_SIZE];
+  int16_t entryNum = (r->entryNum < 0)?(ES.getNbEntries() - 1):r->entryNum;
+
+  switch(r->op)
+  {
+    case OP_INSERT:
+      makeEntry(&entry, r->title);
+      ES.insertEntry(&entry);
+      break;
+    case OP_UPDATE:
+      ES.getTitle(entryNum, title);
+      makeEntry(&entry, (r->title)?r->title:title);
+      strcpy(entry.data + entry.passwordOffset, "changed");
+      ES.updateEntry(entryNum, &entry);
+      break;
+    case OP_REMOVE:
+      ES.removeEntry(entryNum);
+      break;
+  }
+  eeprom.flush();
+}
+
+// Titles as after an interrupted run. The others keep their order, the entry
+// inserted or removed may show up last instead of in its place. The one
+// updated may keep its old place under its new title.
+static const char* check(const std::vector<std::string>& list, const std::vector<std::string>& before,
+                         const std::vector<std::string>& after, const std::string& moved, uint8_t op)
+{
+  std::vector<std::string> rest;
+  uint8_t bad[8];
+  uint32_t elapsed;
+
+  for(size_t i = 0; i < list.size(); i++)
+  {
+    if( list[i].empty() ) return("empty entry");
+  }
+
+  std::vector<std::string> sorted = list;
+  std::sort(sorted.begin(), sorted.end());
+  if( (sorted != before) && (sorted != after) ) return("entries lost or doubled");
+
+  for(size_t i = 0; i < list.size(); i++)
+  {
+    if( list[i] != moved ) rest.push_back(list[i]);
+  }
+  if( !std::is_sorted(rest.begin(), rest.end()) ) return("out of order");
+  if( (op != OP_UPDATE) && !std::is_sorted(list.begin(), list.end()) && (list.back() != moved) )
+  {
+    return("out of order");
+  }
+
+  if( ES.scrub(bad, sizeof(bad), &elapsed) ) return("check value mismatch");
+
+  return(NULL);
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr, "usage: %s [-k chipKB] [-i entries] [-s seed] image\n"
+                  "The image is overwritten.\n", name);
+}
+
+int main(int argc, char** argv)
+{
+  eeprom_image_config_t config = { 8192, 1, 5000 };
+  int entries = 40;
+  char name[DEVNAME_BUFF_LEN];
+  int opt;
+
+  while( (opt = getopt(argc, argv, "k:i:s:")) != -1 )
+  {
+    switch(opt)
+    {
+      case 'k': config.chipSize = atoi(optarg) * 1024; break;
+      case 'i': entries = atoi(optarg); break;
+      case 's': randomSeed(atoi(optarg)); break;
+      default: usage(argv[0]); return(1);
+    }
+  }
+  if(optind != argc - 1)
+  {
+    usage(argv[0]);
+    return(1);
+  }
+
+  unlink(argv[optind]);
+  if( !eepromImageOpen(argv[optind], &config) )
+  {
+    fprintf(stderr, "cannot map %s as %u x %u bytes\n", argv[optind], config.nbChips, config.chipSize);
+    return(1);
+  }
+  i2c.begin();
+
+  ES.initialize();
+  memset(name, 0, sizeof(name));
+  strcpy(name, "host");
+  makeKey("0000");
+  ES.format(key, name);
+  boot();
+
+  for(int i = 0; (i < entries) && (ES.getNbEntries() < ES.getMaxEntries() - 1); i++)
+  {
+    entry_t entry;
+    makeEntry(&entry, NULL);
+    ES.insertEntry(&entry);
+  }
+  eeprom.flush();
+  printf("%u entries of %u, %u byte write pages\n", ES.getNbEntries(), ES.getMaxEntries(), eeprom.getWritePage());
+
+  std::vector<byte> start(eepromImageSize());
+  eepromImageSave(start.data());
+  std::vector<std::string> before = titles();
+  std::sort(before.begin(), before.end());
+
+  for(size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++)
+  {
+    std::string moved;
+
+    // Uninterrupted first, for the outcome and the number of page writes
+    eepromImageLoad(start.data());
+    boot();
+    if( runs[r].op == OP_INSERT )
+    {
+      moved = runs[r].title;
+    } else {
+      char title[ENTRY_TITLE_SIZE];
+      ES.getTitle((runs[r].entryNum < 0)?(ES.getNbEntries() - 1):runs[r].entryNum, title);
+      moved = (runs[r].title)?runs[r].title:title;
+    }
+    uint32_t writes = eepromImageGetStats().writeCycles;
+    run(&runs[r]);
+    writes = eepromImageGetStats().writeCycles - writes;
+    boot();
+    std::vector<std::string> after = titles();
+    std::sort(after.begin(), after.end());
+
+    for(uint32_t cut = 0; cut < writes; cut++)
+    {
+      eepromImageLoad(start.data());
+      boot();
+      eepromImageCutPower(cut);
+      run(&runs[r]);
+      eepromImageCutPower(-1);
+
+      const char* failed = (boot())?NULL:"pin refused";
+      std::vector<std::string> list = titles();
+      if( !failed )
+      {
+        failed = check(list, before, after, moved, runs[r].op);
+      }
+      if( failed )
+      {
+        printf("%s %s: power cut after %u of %u writes: %s\n", opNames[runs[r].op], moved.c_str(),
+               cut, writes, failed);
+        for(size_t i = 0; i < list.size(); i++)
+        {
+          printf("%3u %s\n", (unsigned)i, list[i].c_str());
+        }
+        eepromImageClose();
+        return(1);
+      }
+    }
+    printf("%s %s: %u power cuts, ok\n", opNames[runs[r].op], moved.c_str(), writes);
+  }
+
+  eepromImageClose();
+  return(0);
+}
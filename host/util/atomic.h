@@ -0,0 +1,8 @@
+#ifndef __host_atomic_H__
+#define __host_atomic_H__
+
+//Single threaded, nothing to protect against
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type)
+
+#endif
@@ -0,0 +1,186 @@
+#include <avr/interrupt.h>
+#include <util/twi.h>
+#include "i2c.h"
+
+// Longest transaction is a full display frame (513 bytes, ~47ms at 100kHz).
+// Past that the bus is considered stuck, e.g. a slave holding SDA low.
+#define I2C_TIMEOUT_US 100000L
+
+#define TWCR_IDLE  (_BV(TWEN))
+#define TWCR_START (_BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA))
+#define TWCR_STOP  (_BV(TWEN) | _BV(TWINT) | _BV(TWSTO))
+#define TWCR_NEXT  (_BV(TWEN) | _BV(TWIE) | _BV(TWINT))
+#define TWCR_ACK   (_BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA))
+
+// Current transaction, walked by the TWI interrupt.
+// Only touched by the foreground while the bus is idle.
+static volatile uint8_t twiSla;
+static const byte* volatile twiHdr;
+static volatile uint8_t twiHdrLen;
+static const byte* volatile twiTx;
+static volatile uint16_t twiTxLen;
+static byte* volatile twiRx;
+static volatile uint8_t twiRxLen;
+static volatile uint8_t twiBusy;
+static volatile uint8_t twiStatus;
+
+static void twiStop(uint8_t status)
+{
+  twiStatus = status;
+  TWCR = TWCR_STOP;
+  
+  // TWSTO clears once the STOP condition is on the bus
+  while(TWCR & _BV(TWSTO));
+  twiBusy = 0;
+}
+
+ISR(TWI_vect)
+{
+  switch(TW_STATUS)
+  {
+    case TW_START:
+    case TW_REP_START:
+      TWDR = twiSla;
+      TWCR = TWCR_NEXT;
+      break;
+
+    // Master transmitter: header first, then payload
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+      if(twiHdrLen) {
+        TWDR = *twiHdr++;
+        twiHdrLen--;
+        TWCR = TWCR_NEXT;
+      } else if(twiTxLen) {
+        TWDR = *twiTx++;
+        twiTxLen--;
+        TWCR = TWCR_NEXT;
+      } else if(twiRxLen) {
+        // Turn the bus around with a repeated START
+        twiSla |= TW_READ;
+        TWCR = TWCR_START;
+      } else {
+        twiStop(I2C_OK);
+      }
+      break;
+
+    case TW_MT_SLA_NACK:
+      twiStop(I2C_ADDR_NACK);
+      break;
+
+    case TW_MT_DATA_NACK:
+      twiStop(I2C_DATA_NACK);
+      break;
+
+    // Master receiver: ACK every byte but the last one
+    case TW_MR_DATA_ACK:
+      *twiRx++ = TWDR;
+      twiRxLen--;
+      // fall through, the next byte is acked the same way
+    case TW_MR_SLA_ACK:
+      TWCR = (twiRxLen > 1)?TWCR_ACK:TWCR_NEXT;
+      break;
+
+    case TW_MR_DATA_NACK:
+      *twiRx++ = TWDR;
+      twiRxLen--;
+      twiStop(I2C_OK);
+      break;
+
+    case TW_MR_SLA_NACK:
+      twiStop(I2C_ADDR_NACK);
+      break;
+
+    case TW_MT_ARB_LOST:
+      // Release the bus without STOP
+      twiStatus = I2C_ERROR;
+      TWCR = TWCR_IDLE | _BV(TWINT);
+      twiBusy = 0;
+      break;
+
+    default:
+      // Bus error or unexpected state
+      twiStop(I2C_ERROR);
+      break;
+  }
+}
+
+void I2C::begin()
+{
+  // Activate internal pull-ups, as Wire does
+  digitalWrite(SDA, 1);
+  digitalWrite(SCL, 1);
+
+  // Prescaler 1
+  TWSR &= ~(_BV(TWPS0) | _BV(TWPS1));
+  setClock(I2C_DEFAULT_CLOCK);
+
+  TWCR = TWCR_IDLE;
+}
+
+void I2C::setClock(uint32_t frequency)
+{
+  // SCL = F_CPU / (16 + 2 * TWBR), TWBR 0 is the fastest the TWI can go
+  if(frequency > (F_CPU / 16)) frequency = F_CPU / 16;
+  TWBR = ((F_CPU / frequency) - 16) / 2;
+  clock = frequency;
+}
+
+uint32_t I2C::getClock()
+{
+  return(clock);
+}
+
+uint8_t I2C::transfer()
+{
+  unsigned long start = micros();
+
+  twiStatus = I2C_ERROR;
+  twiBusy = 1;
+  TWCR = TWCR_START;
+
+  while(twiBusy)
+  {
+    if( (micros() - start) > I2C_TIMEOUT_US )
+    {
+      // Reset the peripheral so the next transaction starts from a clean state
+      TWCR = 0;
+      twiBusy = 0;
+      TWCR = TWCR_IDLE;
+      return(I2C_ERROR);
+    }
+  }
+
+  return(twiStatus);
+}
+
+uint8_t I2C::write(uint8_t address, const byte* hdr, uint8_t hdrLen, const byte* data, uint16_t dataLen)
+{
+  twiSla = (address << 1) | TW_WRITE;
+  twiHdr = hdr;
+  twiHdrLen = hdrLen;
+  twiTx = data;
+  twiTxLen = dataLen;
+  twiRxLen = 0;
+
+  return(transfer());
+}
+
+uint8_t I2C::read(uint8_t address, const byte* hdr, uint8_t hdrLen, byte* data, uint8_t len)
+{
+  twiSla = (address << 1) | ((hdrLen)?TW_WRITE:TW_READ);
+  twiHdr = hdr;
+  twiHdrLen = hdrLen;
+  twiTxLen = 0;
+  twiRx = data;
+  twiRxLen = len;
+
+  return(transfer());
+}
+
+bool I2C::probe(uint8_t address)
+{
+  return( write(address, 0, 0, 0, 0) == I2C_OK );
+}
+
+I2C i2c = I2C();
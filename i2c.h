@@ -0,0 +1,60 @@
+/*
+  The Final Key is an encrypted hardware password manager, 
+  this is the sourcecode for the firmware. 
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __i2c_H__
+#define __i2c_H__
+#include <Arduino.h>
+
+//Interrupt-driven TWI master shared by the EEPROM and the display.
+//Unlike Wire it holds no buffer of its own: the interrupt streams straight
+//from/to the caller buffers, so transaction length is not capped at 32 bytes.
+
+#define I2C_DEFAULT_CLOCK 100000L
+#define I2C_FAST_CLOCK 400000L
+#define I2C_FASTPLUS_CLOCK 1000000L
+
+//Transaction status, same codes as Wire.endTransmission()
+#define I2C_OK 0
+#define I2C_ADDR_NACK 2
+#define I2C_DATA_NACK 3
+#define I2C_ERROR 4
+
+class I2C
+{
+public:
+  void begin();
+  void setClock(uint32_t frequency);
+  uint32_t getClock();
+
+  //Sends hdr then data in a single transaction.
+  uint8_t write(uint8_t address, const byte* hdr, uint8_t hdrLen, const byte* data, uint16_t dataLen);
+
+  //Sends hdr then reads len bytes after a repeated START. With no hdr, plain read.
+  uint8_t read(uint8_t address, const byte* hdr, uint8_t hdrLen, byte* data, uint8_t len);
+
+  //Addresses the device without payload, true if it ACKed.
+  bool probe(uint8_t address);
+
+private:
+  uint8_t transfer();
+  uint32_t clock;
+};
+
+extern I2C i2c;
+
+#endif
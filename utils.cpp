@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "i2c.h"
 #include "eeprom.h"
 #include "display.h"
 #include "constants.h"
@@ -65,6 +66,7 @@ void testEEPROM(int index) {
   
   uint16_t offset = 0; 
   offset = I2E_Write( EEPROM_TEST_OFFSET,(byte*)"test4", 224 );
+  eeprom.flush();
   
   I2E_Read(EEPROM_TEST_OFFSET, (byte*)readbackBuffer, 32);
 
@@ -82,6 +84,7 @@ void messUpEEPROMFormat() {
   // overwrite the identifier
   byte writeBuffer[32];
   I2E_Write(0, writeBuffer, 12);
+  eeprom.flush();
 }
 void printHexBuff(byte* buff, char* name, int len) {
     Serial.print("\n");
@@ -175,16 +178,15 @@ void I2Cscan() {
   byte error, address;
   int nDevices;
  
-  Serial.println("Scanning...");
+  Serial.print("Scanning at "); Serial.print(i2c.getClock()); Serial.println("Hz...");
  
   nDevices = 0;
   for(address = 1; address < 127; address++ )
   {
     // The i2c_scanner uses the return value of
-    // the Write.endTransmisstion to see if
+    // an empty write to see if
     // a device did acknowledge to the address.
-    Wire.beginTransmission(address);
-    error = Wire.endTransmission();
+    error = i2c.write(address, 0, 0, 0, 0);
  
     if (error == 0)
     {
@@ -212,6 +214,113 @@ void I2Cscan() {
   delay(5000);           // wait 5 seconds for next scan
 }
 
+// Both devices are exercised at the given clock, true if every transaction went through
+// and the EEPROM returned the same bytes as the reference read done at default speed.
+static bool I2CcheckClock(uint32_t frequency, byte* reference) {
+  byte addr[2] = { (byte)(EEPROM_TEST_OFFSET >> 8), (byte)(EEPROM_TEST_OFFSET & 0xFF) };
+  byte nop[2] = { 0x00, SSD1306_NOP };
+  byte buff[32];
+  bool ok = true;
+
+  i2c.setClock(frequency);
+
+  for(uint8_t i = 0; ok && (i < I2C_PROBE_ROUNDS); i++)
+  {
+    // The display is write-only, a command it ignores tells whether it keeps up
+    ok = (i2c.write(DISPLAY_I2C_ADDR, nop, 2, 0, 0) == I2C_OK);
+
+    if(ok)
+    {
+      ok = (i2c.read(EEPROM_I2C_ADDR, addr, 2, buff, sizeof(buff)) == I2C_OK) &&
+           (memcmp(buff, reference, sizeof(buff)) == 0);
+    }
+  }
+
+  i2c.setClock(I2C_DEFAULT_CLOCK);
+  return ok;
+}
+
+// Picks the fastest bus speed both the display and the EEPROM handle, and switches to it.
+// Must run after display.begin().
+uint32_t I2CprobeClock() {
+  static const uint32_t clocks[] = { I2C_FASTPLUS_CLOCK, I2C_FAST_CLOCK };
+  byte reference[32];
+  byte addr[2] = { (byte)(EEPROM_TEST_OFFSET >> 8), (byte)(EEPROM_TEST_OFFSET & 0xFF) };
+  uint32_t best = I2C_DEFAULT_CLOCK;
+
+  eeprom.release();
+  i2c.setClock(I2C_DEFAULT_CLOCK);
+
+  if( i2c.read(EEPROM_I2C_ADDR, addr, 2, reference, sizeof(reference)) == I2C_OK )
+  {
+    for(uint8_t i = 0; i < sizeof(clocks)/sizeof(clocks[0]); i++)
+    {
+      if( (clocks[i] <= I2C_MAX_CLOCK) && I2CcheckClock(clocks[i], reference) )
+      {
+        best = clocks[i];
+        break;
+      }
+    }
+  }
+
+  i2c.setClock(best);
+  return best;
+}
+
+// Prints display flush and entry-sized EEPROM read times at each bus speed.
+// Reads go straight to the chip, the EEPROM page cache would hide the bus otherwise.
+void I2Cbenchmark() {
+  static const uint32_t clocks[] = { I2C_DEFAULT_CLOCK, I2C_FAST_CLOCK, I2C_FASTPLUS_CLOCK };
+  byte addr[2] = { (byte)(EEPROM_TEST_OFFSET >> 8), (byte)(EEPROM_TEST_OFFSET & 0xFF) };
+  byte buff[96];
+  uint32_t current = i2c.getClock();
+  unsigned long start, flushTime, readTime;
+
+  eeprom.release();
+
+  for(uint8_t i = 0; i < sizeof(clocks)/sizeof(clocks[0]); i++)
+  {
+    i2c.setClock(clocks[i]);
+
+    start = micros();
+    for(uint8_t j = 0; j < 8; j++) display.display();
+    flushTime = (micros() - start) / 8;
+
+    start = micros();
+    for(uint8_t j = 0; j < 8; j++) i2c.read(EEPROM_I2C_ADDR, addr, 2, buff, sizeof(buff));
+    readTime = (micros() - start) / 8;
+
+    Serial.print(clocks[i]); Serial.print("Hz: display flush "); Serial.print(flushTime);
+    Serial.print("us, entry read "); Serial.print(readTime); Serial.println("us");
+  }
+
+  i2c.setClock(current);
+}
+
+const static char ioTagNames[EEPROM_TAG_COUNT][10] PROGMEM = {
+  "other", "unlock", "getTitle", "insert", "remove", "format", "update", "scrub", "getField", "pinChange"
+};
+
+// One line per caller tag that did any EEPROM I/O since last call, counters are reset.
+void printEEPROMIoStats() {
+  char name[10];
+  
+  for(uint8_t i = 0; i < EEPROM_TAG_COUNT; i++)
+  {
+    eeprom_io_stats_t io = eeprom.getIoStats(i);
+    if(!io.transactions) continue;
+    
+    getStringFromFlash(name, (uint8_t*)ioTagNames[i]);
+    Serial.print(name);
+    Serial.print(": xfers "); Serial.print(io.transactions);
+    Serial.print(", rd "); Serial.print(io.bytesRead);
+    Serial.print("B, wr "); Serial.print(io.bytesWritten);
+    Serial.print("B, cycles "); Serial.print(io.pageWrites);
+    Serial.print(", wait "); Serial.print(io.waitTime / 1000); Serial.println("ms");
+  }
+  eeprom.resetIoStats();
+}
+
 // Modulus function that handles negative numbers
 int mod(int x, int m) {
     return (x%m + m)%m;
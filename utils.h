@@ -19,7 +19,6 @@
 #ifndef __utils_H__
 #define __utils_H__
 
-#include <Wire.h>
 #include <TermTool.h>
 
 void displayMessage(char* msg, int X, int Y); 
@@ -34,6 +33,9 @@ uint16_t StackMarginWaterMark(void);
 void printSRAMMap();
 void printCurrentStackMargin();
 void I2Cscan();
+uint32_t I2CprobeClock();
+void I2Cbenchmark();
+void printEEPROMIoStats();
 int mod(int x, int m);
 
 #endif